@@ -1,11 +1,25 @@
 // Mason Lohnes, CST-315, Combined Shell with Process Scheduler and File Management
 // Unified Shell: Simple Round Robin + Priority + Aging Scheduler + File Operations
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <regex.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include <ctype.h>
 #include <termios.h>
 #include <signal.h>
@@ -22,16 +36,209 @@
 #define MAX_LINE 1024
 #define MAX_ARGS 64
 #define MAX_COMMANDS 10
-#define MAX_PROCESSES 64
+#define DEFAULT_PROCESSES 64   // Process slots; override with -m or VMM_PROCESSES
+#define MAX_PROCESSES_LIMIT (1 << 20)
 #define TIME_SLICE 100000      // 100ms - simple fixed time slice
 #define AGING_BOOST 5          // Priority boost every 5 cycles
 #define IO_TIME 200000         // 200ms I/O simulation
+#define AGING_TICK 10000       // 10ms per aging cycle
+#define AGING_PERIOD (AGING_BOOST * AGING_TICK)  // Time in a level before promotion
+#define PRIORITY_LEVELS 3      // 0=high ... PRIORITY_LEVELS-1=low (max 32)
+#define CACHE_LINE 64
+#define CFS_LATENCY 100000     // Period in which every ready PCB should run once
+#define CFS_MIN_GRANULARITY 20000  // Shortest CFS slice
+#define CFS_NICE0_WEIGHT 1024
+#define MLFQ_BOOST_PERIOD 1000000  // MLFQ moves everything back to the top every 1s
+#define TURNAROUND_SAMPLES 1024    // Completions kept for latency percentiles
+#define MAX_CPUS 256
+
+// VMM defaults; override with -p/-f/-v/-s/-m or VMM_* environment variables
+#define DEFAULT_PAGE_SIZE 4096
+#define DEFAULT_FRAMES 16
+#define DEFAULT_VIRTUAL_PAGES 262144   // 1 GB of 4 KB pages; tables are sparse
+#define DEFAULT_SWAP_SLOTS 32
+
+// Packed page table entry. The index field holds the frame while the page
+// is present and its ARC ghost while it is not; the swap field holds the
+// slot whenever PTE_SWAPPED is set, present or not.
+#define PTE_PRESENT (1ULL << 0)
+#define PTE_DIRTY (1ULL << 1)
+#define PTE_ACCESSED (1ULL << 2)
+#define PTE_SWAPPED (1ULL << 3)
+#define PTE_GHOST (1ULL << 4)
+#define PTE_INDEX_SHIFT 5
+#define PTE_INDEX_BITS 29
+#define PTE_INDEX_FIELD (((1ULL << PTE_INDEX_BITS) - 1) << PTE_INDEX_SHIFT)
+#define PTE_SWAP_SHIFT (PTE_INDEX_SHIFT + PTE_INDEX_BITS)
+#define PTE_SWAP_FIELD (~0ULL << PTE_SWAP_SHIFT)
+#define PTE_MAX_FRAMES (1 << (PTE_INDEX_BITS - 1))  // Ghosts need 2 * frames
+#define PTE_MAX_SWAP_SLOTS (1 << 30)
+#define PT_LEVEL_BITS 9         // 512 entries per node, 4 KB each
+#define PT_FANOUT (1 << PT_LEVEL_BITS)
+#define TRACE_MAGIC "VMTR"
+#define TRACE_VERSION 1
+#define TRACE_WRITE 1           // trace_record_t flags
+#define REPLAY_BATCH 4096       // Records replayed per vmm.lock hold
+#define PFF_WINDOW 64           // Accesses per page-fault-frequency sample
+#define PFF_HIGH 10             // Fault % above which a quota grows
+#define PFF_LOW 2               // Fault % below which a quota shrinks
+#define PFF_GROW 4              // Frames granted per high sample
+#define PFF_MIN_QUOTA 2
+#define PFF_INITIAL_QUOTA 4
+#define PFF_SUSPEND_TIME 500000 // How long a thrashing process is swapped out (us)
+#define TLB_SETS 16             // Power of two
+#define TLB_WAYS 4
+
+#define SWAP_IO_WORKERS 2
+#define SWAP_IO_DEPTH 32        // Write-backs in flight before eviction waits
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+#define FRAME_TABLE_MAX 64     // Larger memories print a summary, not every frame
+#define ACCESS_INTERVAL 1000   // One synthetic memory access per 1ms of run time
+#define MAX_ACCESS_BURST 1000  // Cap on accesses replayed in one scheduler pass
+#define CREATE_CHUNK (1 << 20)  // create streams through one reusable 1 MB buffer
+#define COPY_MAX_NAMES 10000    // Give up looking for a free copy name after this
+#define WALK_THREADS 8          // Directory walker threads; I/O bound, so not tied to cores
+#define WALK_BUF (64 * 1024)    // getdents64 buffer per walker thread
+
+#define INDEX_MAGIC "LSIX"
+#define INDEX_VERSION 1
+#define INDEX_FILE ".lopeshell_index"   // In $HOME; one indexed tree at a time
+#define INDEX_ROOT UINT32_MAX           // Parent of top-level entries
+#define INDEX_DELTA_MAX 4096    // Changes held in memory before a background rebuild
+#define INDEX_POLL 200          // ms between checks for shutdown in the watcher
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                          IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+// How create fills a file
+typedef enum {
+    FILL_RANDOM,
+    FILL_SPARSE,    // Hole of the requested size, nothing written
+    FILL_ALLOC,     // fallocate: blocks reserved, reads as zeros
+    FILL_PATTERN    // Repeat a string
+} FillMode;
+
+// xoshiro256** on 8 independent lanes. GCC vector extensions turn each
+// step into SIMD (64 bytes of output) on whatever the target offers.
+typedef uint64_t u64x8 __attribute__((vector_size(64)));
+typedef struct {
+    u64x8 s[4];
+} RandomStream;
+
+// Directory walker. Directories are scanned by a pool of threads, each
+// with its own deque; a thread works depth first from the tail of its own
+// deque and steals from the head of the others when it runs dry.
+typedef struct WalkDir {
+    char* path;
+    int depth;              // 0 for the root
+    void* ctx;              // Set by the visit that descended into it
+    struct WalkDir* parent;
+    int refs;               // Own scan + unfinished subdirectories (walker lock)
+} WalkDir;
+
+typedef struct {
+    WalkDir* dir;           // Directory being scanned
+    int dir_fd;             // Open on dir, for the *at calls
+    const char* name;
+    unsigned char type;     // DT_*; fstatat is only used when d_type is DT_UNKNOWN
+    void* child_ctx;        // Visit sets this when it descends into a directory
+} WalkEntry;
+
+typedef struct {
+    WalkDir** items;        // Ring buffer
+    int head;
+    int count;
+    int cap;
+    pthread_mutex_t lock;
+} WalkQueue;
+
+typedef struct Walker {
+    // Called concurrently from every walker thread. Returns nonzero to
+    // descend into a directory entry.
+    int (*visit)(struct Walker* w, WalkEntry* e);
+    // Optional, called once everything below dir has been visited and left
+    void (*leave)(struct Walker* w, WalkDir* dir);
+    void* arg;
+    int max_depth;          // 0 for no limit
+    const char* errors_as;  // Prefix for open errors (EACCES is only counted)
+    volatile int* cancel;   // Optional; once nonzero, remaining directories are skipped
+    int threads;
+    WalkQueue queues[WALK_THREADS];
+    pthread_mutex_t lock;   // Counters below and WalkDir.refs
+    pthread_cond_t wake;
+    long queued;            // Directories waiting in the deques
+    long pending;           // Queued or being scanned
+    int idle;
+    long dirs;
+    long entries;
+    long errors;
+    pthread_mutex_t result_lock;  // For visit callbacks to use
+} Walker;
+
+typedef struct {
+    Walker* w;
+    int self;
+} WalkThread;
+
+// Filename index file: header, root path (padded to 8 bytes), entries
+// sorted by name, then the names, each NUL terminated, in the same order.
+// Paths are rebuilt by following parents, so each name is stored once.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t root_len;
+    uint64_t names_size;
+    int64_t built;          // time_t
+} index_header_t;
+
+typedef struct {
+    uint32_t name_off;
+    uint32_t parent;        // Entry index of the containing directory, or INDEX_ROOT
+} index_entry_t;
+
+// One path in the index delta. The sequence numbers order creates and
+// deletes: a path is visible if it was added after the last delete of it
+// or of any directory above it.
+typedef struct {
+    char* path;             // Relative to the index root; NULL for an empty slot
+    uint32_t hash;
+    long added;             // Sequence of the last create/move in, 0 if none
+    long deleted;           // Sequence of the last delete/move out, 0 if none
+} IndexChange;
+
+// The loaded index plus the changes inotify has reported since it was
+// built. Paths in the delta are relative to root.
+typedef struct {
+    pthread_mutex_t lock;   // Mapping and delta
+    char root[PATH_MAX];
+    void* map;
+    size_t map_size;
+    const index_header_t* hdr;
+    const index_entry_t* entries;
+    const char* names;
+    IndexChange* delta;     // Open addressing, power-of-two capacity
+    int delta_cap;
+    int delta_count;
+    long delta_seq;
+    long changes;           // Events applied since the last build
+    int inotify_fd;
+    char** watch_paths;     // Relative directory path by watch descriptor
+    int watch_cap;
+    long watches;
+    int watch_full;         // Ran out of inotify watches; parts may go stale
+    int rebuild;            // Watcher should rebuild from a fresh walk
+    pthread_t thread;
+    volatile int running;
+    volatile int stopping;  // Cancels a walk in progress
+} FileIndex;
 
-// VMM Constants
-#define PAGE_SIZE 4096
-#define PHYSICAL_FRAMES 16
-#define VIRTUAL_PAGES 64
-#define SWAP_SLOTS 32
+typedef struct {
+    char** paths;
+    long count;
+    long cap;
+    size_t root_len;
+    int watch;              // Add inotify watches on the directories
+} IndexBuild;
 
 // Process states
 typedef enum {
@@ -42,655 +249,4686 @@ typedef enum {
     PROC_TERMINATED
 } ProcessState;
 
+// How scheduler decisions are applied to the real children
+typedef enum {
+    ENFORCE_OFF,    // Simulation only
+    ENFORCE_STOP,   // SIGSTOP everything but the RUNNING PCBs
+    ENFORCE_NICE    // Map priority levels to nice values
+} EnforceMode;
+
 // VMM structures
-typedef struct {
-    int frame_number;
-    int is_present;
-    int is_dirty;
-    int swap_slot;
-} page_entry_t;
+typedef uint64_t pte_t;
+
+// Radix page table node: child pointers, or PTEs at the last level.
+// Nodes are allocated on the first fault in the range they cover.
+typedef union PageTableNode {
+    union PageTableNode *child[PT_FANOUT];
+    pte_t pte[PT_FANOUT];
+} PageTableNode;
 
 typedef struct {
     int is_used;
     int process_id;
+    int proc_index;         // Owning process slot (reverse map with page_number)
     int page_number;
     int load_time;
+    int referenced;         // Reference bit (clock, second chance)
+    int list;               // ARC list holding the frame: 1 = T1, 2 = T2
+    int prev;               // Replacement list links, -1 at the ends
+    int next;
+    int owner_prev;         // Owning process's resident list links
+    int owner_next;
+    int clean;              // Clean list holding the frame (1 or 2), 0 once dirty
+    int clean_prev;         // Clean list links
+    int clean_next;
+    unsigned long last_use; // Local LRU for quota replacement
 } frame_entry_t;
 
+// Binary access trace: one header, then fixed-size records
+typedef struct {
+    char magic[4];          // TRACE_MAGIC
+    uint32_t version;
+    uint64_t count;         // Records that follow
+} trace_header_t;
+
+typedef struct {
+    uint64_t vaddr;
+    uint32_t pid;
+    uint32_t flags;
+} trace_record_t;
+
+// Cached translation, tagged with the address space (process slot)
+typedef struct {
+    int asid;               // -1 if the entry is invalid
+    int page;
+    int frame;
+    int dirty;              // PTE already marked dirty through this entry
+    unsigned long last_use; // LRU within the set
+} tlb_entry_t;
+
+// Intrusive list of frames (or ARC ghosts), head = oldest / least recent
+typedef struct {
+    int head;
+    int tail;
+    int count;
+} FrameList;
+
+// A page ARC recently evicted, kept by identity only
+typedef struct {
+    int proc_index;
+    int page_number;
+    int list;               // 1 = B1, 2 = B2
+    int prev;
+    int next;
+} ghost_entry_t;
+
 typedef struct {
     int pid;
-    int memory_size;
+    long memory_size;
     int num_pages;
-    page_entry_t *page_table;
+    PageTableNode *page_table;  // Radix root, NULL until the first fault
+    long pt_nodes;
+    int last_page;          // Locality anchor for the synthetic access stream
+    long accesses;
+    long faults;
+    int resident;           // Frames currently holding this process's pages
+    int resident_head;      // First frame of the resident list, -1 if none
+    int swapped;            // Pages holding a swap slot
+    int ghosts;             // Pages remembered by ARC ghosts
+    int quota;              // Frame allowance under PFF allocation
+    int window_accesses;    // Current PFF sample
+    int window_faults;
+    int fault_rate;         // % faults in the last complete sample
+    int thrashing;          // Wants frames the PFF allocator cannot give
 } process_info_t;
 
+// One write-back of an evicted page to the swap file
+typedef struct SwapRequest {
+    int slot;
+    char *buf;              // Private copy of the frame
+    int done;
+    int error;              // errno of a failed transfer
+    long submitted;
+    struct SwapRequest *next;
+} SwapRequest;
+
+// Swap file plus the worker pool that writes evicted pages back in the
+// background. Reads are synchronous: the faulting CPU reads the page itself
+// with vmm.lock held, so every other VMM user waits for that one read.
+typedef struct {
+    int fd;
+    int started;
+    pid_t owner;            // Forked children must leave the workers alone
+    pthread_t workers[SWAP_IO_WORKERS];
+    pthread_mutex_t lock;   // Taken after vmm.lock, never before
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    SwapRequest *head, *tail;
+    SwapRequest *completed; // Finished writes not yet reaped by the VMM
+    int writes_in_flight;
+    int stop;
+    long reads;
+    long writes;
+    long cached_reads;      // Served from a write-back still in memory
+    long errors;
+    long read_wait_us;      // Time faulting processes spent waiting on reads
+    long write_us;
+} SwapDevice;
+
+// Geometry is fixed by init_vmm except num_frames (vmm resize); every table
+// below is heap-allocated to match it
 typedef struct {
-    frame_entry_t frames[PHYSICAL_FRAMES];
-    process_info_t processes[MAX_PROCESSES];
-    int swap_used[SWAP_SLOTS];
+    int page_size;
+    int num_frames;
+    int virtual_pages;      // Per process
+    int swap_slots;
+    int max_processes;      // Process slots
+    frame_entry_t *frames;
+    char *memory;           // Simulated physical memory, num_frames pages
+    size_t memory_size;
+    uint64_t *free_frames;  // Bit set = frame free
+    process_info_t *processes;
+    int pt_levels;          // Radix depth needed for virtual_pages
+    long pt_nodes;          // Page table nodes across all processes
+    int *free_slots;        // Stack of unused process slots
+    int num_free_slots;
+    uint64_t *free_swap;    // Bit set = swap slot free
+    int swap_free;          // Set bits in free_swap
+    SwapRequest **swap_pending;  // Last write-back issued per slot
     int next_frame_time;
     int num_processes;
+    long total_accesses;
+    long total_faults;
+    long failed_faults;     // Swap read failed; the page stays in swap
+    long evictions;
+    long swap_writes;
+    long swap_drops;        // Dirty pages lost because swap was full
+    int pff;                // Per-process quotas instead of one global pool
+    long total_quota;       // Sum of live processes' quotas
+    unsigned long use_clock;
+    long thrash_suspends;
+    FrameList resident;     // Load or recency order (fifo, second, lru)
+    FrameList clean[2];     // Clean resident frames in policy order (ARC: T1, T2)
+    int clock_hand;
+    FrameList arc_t1, arc_t2;    // ARC: seen once / seen twice, resident
+    FrameList arc_b1, arc_b2;    // ARC: ghosts evicted from T1 / T2
+    int arc_p;                   // ARC target size of T1
+    ghost_entry_t *ghosts;  // 2 * num_frames
+    int free_ghost;              // Head of the unused ghost chain
+    tlb_entry_t tlb[TLB_SETS][TLB_WAYS];
+    unsigned long tlb_clock;
+    long tlb_hits;
+    long tlb_misses;
+    long tlb_shootdowns;    // Entries invalidated because their frame was evicted
+    long tlb_flushes;       // Address spaces flushed on exit
+    pthread_mutex_t lock;   // Taken after a CPU lock, never before
 } vmm_t;
 
-// PCB
-typedef struct PCB {
+// Page replacement policy. Hooks run with vmm.lock held.
+typedef struct {
+    const char* name;
+    const char* description;
+    void (*reset)(void);                        // Forget all state
+    void (*on_miss)(int proc_index, int page);  // Before a fault is serviced
+    int (*pick_victim)(int proc_index, int page);  // Unlink and return a frame to evict
+    void (*on_load)(int frame);                 // Frame now holds its page
+    void (*on_access)(int frame);               // Hit on a resident page
+    void (*on_unmap)(int proc_index, int page); // Page of an exiting process
+} ReplacementPolicy;
+
+// PCB (cache-line aligned so pool neighbours never share a line)
+typedef struct __attribute__((aligned(CACHE_LINE))) PCB {
     int pid;
     char command[64];
     ProcessState state;
     int priority; // 0=high, 1=normal, 2=low
     int cpu_time;
     int wait_time;
-    int arrival_time;
-    int last_run;
-    int age_counter;
+    long arrival_time;
+    long last_run;
+    long ready_since;       // When the PCB entered its current ready level
+    long io_deadline;       // When simulated I/O completes (while WAITING)
+    int heap_index;         // Slot in the I/O wait heap, -1 if not waiting
+    int cpu;                // CPU whose queues hold this PCB
     int io_count;
     int memory_allocated;
-    struct PCB* next;
+    long real_cpu_us;       // Kernel-reported user+system time of the child
+    long max_rss_kb;        // Peak resident set size
+    long ctx_switches;      // Voluntary + involuntary context switches
+    long last_burst;        // CPU time of the most recent dispatch
+    long vruntime;          // Weighted CPU time (cfs)
+    long burst_estimate;    // Predicted next burst (sjf)
+    long sched_key;         // Ready tree ordering key
+    int vmm_slot;           // VMM process slot, -1 if none
+    long access_clock;      // Run time already turned into memory accesses
+    struct PCB* rb_parent;  // Ready tree links (cfs, sjf)
+    struct PCB* rb_left;
+    struct PCB* rb_right;
+    int rb_red;
+    int sig_stopped;        // Child held with SIGSTOP (ENFORCE_STOP)
+    int nice_value;         // Nice value applied to the child (ENFORCE_NICE)
+    struct PCB* next;       // Ready-level neighbours (intrusive, O(1) unlink); free-list link
+    struct PCB* prev;
 } PCB;
 
-// Simple queue structure
+// PCB slab: fixed pool with a free list, only touched by the shell thread.
+// Sized once at startup from the same process limit as the VMM slots.
+typedef struct {
+    PCB* slots;
+    int capacity;
+    PCB* free_list;
+    int in_use;
+} PCBPool;
+
+// PID -> PCB index: open addressing, linear probing, power-of-two capacity.
+// Only the shell thread inserts and removes.
+typedef struct {
+    PCB** slots;
+    int capacity;
+    int count;
+} PidTable;
+
+// I/O wait set: binary min-heap keyed by io_deadline
+typedef struct {
+    PCB** items;
+    int count;
+    int capacity;
+} WaitHeap;
+
+// One FIFO per priority level
 typedef struct {
     PCB* head;
+    PCB* tail;
+} PriorityLevel;
+
+// Multi-level ready queue: O(1) enqueue and pick-next
+typedef struct {
+    PriorityLevel levels[PRIORITY_LEVELS];
+    unsigned int bitmap;    // Bit n set when level n is non-empty
     int count;
-    pthread_mutex_t lock;
-} ProcessQueue;
+} ReadyQueue;
 
-// Simple scheduler
+// Ready set for the tree policies: red-black tree ordered by sched_key, with
+// the leftmost node cached so pick-next is O(1)
+typedef struct {
+    PCB* root;
+    PCB* leftmost;
+    long load;              // Sum of queued CFS weights
+    long min_vruntime;      // Monotonic vruntime floor for placing arrivals
+} ReadyTree;
+
+// One simulated CPU with its own run queue, I/O waiters, running slot and
+// scheduling thread. lock guards ready, waiting and running.
 typedef struct {
-    ProcessQueue ready;     // All ready processes
-    ProcessQueue waiting;   // I/O waiting
+    int id;
+    int nr_ready;           // PCBs held by the policy's ready structure
+    ReadyQueue ready;       // Ready processes, by priority (rr, mlfq)
+    ReadyTree tree;         // Ready processes, by key (cfs, sjf)
+    long next_boost;        // Next MLFQ priority boost
+    WaitHeap waiting;       // I/O waiting, earliest completion first
     PCB* running;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    pthread_mutex_t event_lock;  // Guards events_pending
+    pthread_cond_t event_cond;   // Signalled on arrival, exit, steal and shutdown
+    int events_pending;
+    volatile int idle;      // Nothing running or queued; may steal work
+    unsigned int seed;      // rand_r() state for the I/O simulation
+    int dispatches;
+    int steals;
+} CPU;
+
+// Why a PCB is (re)entering a ready structure
+typedef enum {
+    ENQ_NEW,        // New arrival, or carried over from another policy
+    ENQ_WAKEUP,     // I/O completed
+    ENQ_PREEMPT,    // Used up its time slice
+    ENQ_MOVE        // Priority change; no policy adjustment
+} EnqueueReason;
+
+// Scheduling policy. Every hook runs with the CPU lock held.
+typedef struct {
+    const char* name;
+    const char* description;
+    void (*on_enqueue)(CPU* cpu, PCB* p, EnqueueReason why);
+    void (*dequeue)(CPU* cpu, PCB* p);        // Unlink a READY p
+    PCB* (*pick_next)(CPU* cpu);              // Remove and return the next PCB to run
+    long (*on_tick)(CPU* cpu, long now);      // Returns the next time it needs a tick, or 0
+    void (*on_block)(CPU* cpu, PCB* p);       // Running p leaves for I/O
+    void (*on_exit)(CPU* cpu, PCB* p);        // p terminated, in any state
+    void (*on_migrate)(CPU* from, CPU* to, PCB* p);  // p stolen by another CPU
+    long (*time_slice)(CPU* cpu, PCB* p);
+    int (*collect)(CPU* cpu, PCB** out, int max);    // Ready PCBs in dispatch order
+} SchedPolicy;
+
+// Simple scheduler. CPU locks are always taken in ascending id order.
+typedef struct {
+    CPU* cpus;
+    int num_cpus;
+    PidTable pids;          // Every live PCB, whatever its state
     int total_procs;
     int done_procs;
     long total_wait;
     long total_turnaround;
-    int scheduler_on;
-    pthread_t sched_thread;
+    long total_real_cpu;    // Real usage of completed children (wait4)
+    long total_ctx_switches;
+    long peak_rss_kb;
+    long turnaround_samples[TURNAROUND_SAMPLES];  // Ring of recent completions
+    int num_samples;        // Completions since the policy was selected
+    volatile int scheduler_on;
 } SimpleScheduler;
 
 // Global variables
 vmm_t vmm;
+FileIndex file_index = {.lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1};
+SwapDevice swap_device;
+PCBPool pcb_pool;
 SimpleScheduler sched = {0};
 int vmm_verbose = 0;
 int scheduler_verbose = 0;
+EnforceMode enforce_mode = ENFORCE_OFF;
+const char* enforce_names[] = {"off", "stop", "nice"};
+const int priority_nice[PRIORITY_LEVELS] = {0, 10, 19};  // Nice per priority level
+const long priority_weight[PRIORITY_LEVELS] = {1024, 110, 15};  // CFS weights of those nice values
 struct termios original_term;
 pid_t foreground_pgid = 0;
 volatile sig_atomic_t ctrl_x_pressed = 0;
 int is_interactive = 0;
 
-// VMM Implementation
-void init_vmm() {
-    if (vmm_verbose) {
-        printf("Initializing VMM: %d frames, %d KB pages\n", 
-               PHYSICAL_FRAMES, PAGE_SIZE/1024);
-    }
+long get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-    for (int i = 0; i < PHYSICAL_FRAMES; i++) {
-        vmm.frames[i].is_used = 0;
-        vmm.frames[i].process_id = -1;
-    }
+// VMM Implementation
+int pte_frame(pte_t pte) {
+    return (pte & PTE_PRESENT) ? (int)((pte & PTE_INDEX_FIELD) >> PTE_INDEX_SHIFT) : -1;
+}
 
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        vmm.processes[i].pid = -1;
-        vmm.processes[i].page_table = NULL;
-    }
+int pte_ghost(pte_t pte) {
+    return (pte & PTE_GHOST) ? (int)((pte & PTE_INDEX_FIELD) >> PTE_INDEX_SHIFT) : -1;
+}
 
-    for (int i = 0; i < SWAP_SLOTS; i++) {
-        vmm.swap_used[i] = 0;
-    }
+int pte_swap_slot(pte_t pte) {
+    return (pte & PTE_SWAPPED) ? (int)(pte >> PTE_SWAP_SHIFT) : -1;
+}
 
-    vmm.next_frame_time = 1;
-    vmm.num_processes = 0;
+void pte_map(pte_t* pte, int frame) {
+    *pte = (*pte & ~(PTE_INDEX_FIELD | PTE_GHOST)) | PTE_PRESENT | ((pte_t)frame << PTE_INDEX_SHIFT);
 }
 
-int allocate_process_memory(int pid, int memory_size) {
-    int proc_index = -1;
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (vmm.processes[i].pid == -1) {
-            proc_index = i;
-            break;
-        }
-    }
+void pte_unmap(pte_t* pte) {
+    if (*pte & PTE_PRESENT) *pte &= ~(PTE_PRESENT | PTE_ACCESSED | PTE_INDEX_FIELD);
+}
 
-    if (proc_index == -1) return -1;
+// Only pages being evicted become ghosts, so this also drops the mapping
+void pte_set_ghost(pte_t* pte, int ghost) {
+    *pte = (*pte & ~(PTE_INDEX_FIELD | PTE_PRESENT | PTE_ACCESSED)) | PTE_GHOST |
+           ((pte_t)ghost << PTE_INDEX_SHIFT);
+}
 
-    int pages_needed = (memory_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    page_entry_t *page_table = malloc(pages_needed * sizeof(page_entry_t));
-    if (!page_table) return -1;
+void pte_clear_ghost(pte_t* pte) {
+    if (*pte & PTE_GHOST) *pte &= ~(PTE_GHOST | PTE_INDEX_FIELD);
+}
 
-    for (int i = 0; i < pages_needed; i++) {
-        page_table[i].is_present = 0;
-        page_table[i].frame_number = -1;
-    }
+void pte_set_swap(pte_t* pte, int slot) {
+    *pte = (*pte & ~PTE_SWAP_FIELD) | PTE_SWAPPED | ((pte_t)slot << PTE_SWAP_SHIFT);
+}
 
-    vmm.processes[proc_index].pid = pid;
-    vmm.processes[proc_index].memory_size = memory_size;
-    vmm.processes[proc_index].num_pages = pages_needed;
-    vmm.processes[proc_index].page_table = page_table;
-    vmm.num_processes++;
+void pte_clear_swap(pte_t* pte) {
+    *pte &= ~(PTE_SWAPPED | PTE_SWAP_FIELD);
+}
 
-    if (vmm_verbose) {
-        printf("VMM: Allocated %d KB (%d pages) for PID %d\n", 
-               memory_size/1024, pages_needed, pid);
+// Walk the radix table to the PTE of page. Missing nodes are allocated when
+// create is set; otherwise NULL means the page was never touched.
+pte_t* pte_lookup(int proc_index, int page, int create) {
+    process_info_t *proc = &vmm.processes[proc_index];
+    PageTableNode **slot = &proc->page_table;
+    for (int level = vmm.pt_levels - 1; ; level--) {
+        if (!*slot) {
+            if (!create) return NULL;
+            *slot = calloc(1, sizeof(PageTableNode));
+            if (!*slot) return NULL;
+            proc->pt_nodes++;
+            vmm.pt_nodes++;
+        }
+        int index = (page >> (level * PT_LEVEL_BITS)) & (PT_FANOUT - 1);
+        if (level == 0) return &(*slot)->pte[index];
+        slot = &(*slot)->child[index];
     }
-    return 0;
 }
 
-void deallocate_process_memory(int pid) {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (vmm.processes[i].pid == pid) {
-            if (vmm.processes[i].page_table) {
-                free(vmm.processes[i].page_table);
-            }
-            vmm.processes[i].pid = -1;
-            vmm.processes[i].page_table = NULL;
-            vmm.num_processes--;
+// PTE of a page the VMM already tracks (resident, ghost or being faulted in)
+pte_t* page_pte(int proc_index, int page) {
+    return pte_lookup(proc_index, page, 0);
+}
 
-            if (vmm_verbose) {
-                printf("VMM: Deallocated memory for PID %d\n", pid);
-            }
-            break;
+// Call visit on every PTE of the subtree; first_page is the first page it covers
+void pt_walk(int proc_index, PageTableNode* node, int level, int first_page,
+             void (*visit)(int proc_index, int page, pte_t* pte)) {
+    if (!node) return;
+    for (int i = 0; i < PT_FANOUT; i++) {
+        if (level == 0) {
+            if (node->pte[i]) visit(proc_index, first_page + i, &node->pte[i]);
+        } else if (node->child[i]) {
+            pt_walk(proc_index, node->child[i], level - 1,
+                    first_page + (i << (level * PT_LEVEL_BITS)), visit);
         }
     }
 }
 
-// Scheduler Implementation
-long get_time() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000000 + tv.tv_usec;
+void pt_free(PageTableNode* node, int level) {
+    if (!node) return;
+    for (int i = 0; level > 0 && i < PT_FANOUT; i++) pt_free(node->child[i], level - 1);
+    free(node);
 }
 
-void enqueue(ProcessQueue* q, PCB* p) {
-    pthread_mutex_lock(&q->lock);
-    p->next = NULL;
-    if (!q->head) {
-        q->head = p;
-    } else {
-        PCB* curr = q->head;
-        while (curr->next) curr = curr->next;
-        curr->next = p;
-    }
-    q->count++;
+void bitmap_set(uint64_t* map, int i) {
+    map[i >> 6] |= 1ULL << (i & 63);
+}
 
-    if (scheduler_verbose) {
-        printf("Scheduler: Enqueued PID %d (priority %d)\n", p->pid, p->priority);
-    }
-    pthread_mutex_unlock(&q->lock);
+void bitmap_clear(uint64_t* map, int i) {
+    map[i >> 6] &= ~(1ULL << (i & 63));
 }
 
-PCB* dequeue_by_priority(ProcessQueue* q) {
-    pthread_mutex_lock(&q->lock);
+// Mark bits [0, n) set and the tail of the last word clear
+void bitmap_fill(uint64_t* map, int n) {
+    int words = BITMAP_WORDS(n);
+    for (int w = 0; w < words; w++) map[w] = ~0ULL;
+    if (n & 63) map[words - 1] = (1ULL << (n & 63)) - 1;
+}
 
-    if (!q->head) {
-        pthread_mutex_unlock(&q->lock);
-        return NULL;
+// Index of the lowest set bit, or -1
+int bitmap_first_set(const uint64_t* map, int n) {
+    int words = BITMAP_WORDS(n);
+    for (int w = 0; w < words; w++) {
+        if (map[w]) return (w << 6) + __builtin_ctzll(map[w]);
     }
+    return -1;
+}
 
-    // Find highest priority process (lowest number = highest priority)
-    PCB* best = q->head;
-    PCB* best_prev = NULL;
-    PCB* curr = q->head;
-    PCB* prev = NULL;
+int bitmap_count(const uint64_t* map, int n) {
+    int count = 0;
+    for (int w = 0; w < BITMAP_WORDS(n); w++) count += __builtin_popcountll(map[w]);
+    return count;
+}
 
-    while (curr) {
-        if (curr->priority < best->priority) {
-            best = curr;
-            best_prev = prev;
-        }
-        prev = curr;
-        curr = curr->next;
+void frame_list_init(FrameList* l) {
+    l->head = -1;
+    l->tail = -1;
+    l->count = 0;
+}
+
+// Append frame f at the tail (most recent end)
+void frame_list_push(FrameList* l, int f) {
+    vmm.frames[f].prev = l->tail;
+    vmm.frames[f].next = -1;
+    if (l->tail >= 0) {
+        vmm.frames[l->tail].next = f;
+    } else {
+        l->head = f;
     }
+    l->tail = f;
+    l->count++;
+}
 
-    // Remove best from queue
-    if (best_prev) {
-        best_prev->next = best->next;
+void frame_list_unlink(FrameList* l, int f) {
+    frame_entry_t* fr = &vmm.frames[f];
+    if (fr->prev >= 0) {
+        vmm.frames[fr->prev].next = fr->next;
+    } else {
+        l->head = fr->next;
+    }
+    if (fr->next >= 0) {
+        vmm.frames[fr->next].prev = fr->prev;
     } else {
-        q->head = best->next;
+        l->tail = fr->prev;
     }
-    q->count--;
+    fr->prev = -1;
+    fr->next = -1;
+    l->count--;
+}
 
-    pthread_mutex_unlock(&q->lock);
-    return best;
+int frame_list_pop(FrameList* l) {
+    int f = l->head;
+    if (f >= 0) frame_list_unlink(l, f);
+    return f;
 }
 
-PCB* create_process(int pid, const char* cmd, int memory_size) {
-    PCB* p = malloc(sizeof(PCB));
-    if (!p) return NULL;
+// Clean frames are kept on lists of their own, in the same order as the
+// policy list they sit on, so a policy can pass over dirty frames without
+// walking them. A frame leaves its clean list on its first write.
+void clean_reset() {
+    frame_list_init(&vmm.clean[0]);
+    frame_list_init(&vmm.clean[1]);
+}
 
-    p->pid = pid;
-    strncpy(p->command, cmd, 63);
-    p->command[63] = '\0';
-    p->state = PROC_NEW;
-    p->priority = 1;        // Start normal priority
-    p->cpu_time = 0;
-    p->wait_time = 0;
-    p->arrival_time = get_time();
-    p->last_run = 0;
-    p->age_counter = 0;
-    p->io_count = 0;
-    p->memory_allocated = memory_size;
-    p->next = NULL;
+void clean_push(int list, int f) {
+    FrameList* l = &vmm.clean[list - 1];
+    vmm.frames[f].clean = list;
+    vmm.frames[f].clean_prev = l->tail;
+    vmm.frames[f].clean_next = -1;
+    if (l->tail >= 0) {
+        vmm.frames[l->tail].clean_next = f;
+    } else {
+        l->head = f;
+    }
+    l->tail = f;
+    l->count++;
+}
 
-    // Allocate memory through VMM
-    if (allocate_process_memory(pid, memory_size) != 0) {
-        free(p);
-        return NULL;
+void clean_unlink(int f) {
+    frame_entry_t* fr = &vmm.frames[f];
+    if (!fr->clean) return;
+    FrameList* l = &vmm.clean[fr->clean - 1];
+    if (fr->clean_prev >= 0) {
+        vmm.frames[fr->clean_prev].clean_next = fr->clean_next;
+    } else {
+        l->head = fr->clean_next;
+    }
+    if (fr->clean_next >= 0) {
+        vmm.frames[fr->clean_next].clean_prev = fr->clean_prev;
+    } else {
+        l->tail = fr->clean_prev;
     }
+    fr->clean = 0;
+    fr->clean_prev = -1;
+    fr->clean_next = -1;
+    l->count--;
+}
 
-    sched.total_procs++;
+// Move a clean frame to the tail of clean list `list`
+void clean_touch(int list, int f) {
+    if (!vmm.frames[f].clean) return;
+    clean_unlink(f);
+    clean_push(list, f);
+}
 
-    if (scheduler_verbose) {
-        printf("Scheduler: Created PID %d (%s) with %d KB\n", 
-               pid, cmd, memory_size/1024);
-    }
+// With swap full a dirty victim's data would be lost, so the policies pick
+// among clean frames only, as long as there are any
+int clean_only() {
+    return vmm.swap_free == 0 && vmm.clean[0].count + vmm.clean[1].count > 0;
+}
 
-    return p;
+// Policy: fifo - evict in load order
+void fifo_reset() {
+    frame_list_init(&vmm.resident);
 }
 
-void* scheduler_main(void* arg) {
-    while (sched.scheduler_on) {
-        long now = get_time();
+int list_pick_victim(int proc_index, int page) {
+    (void)proc_index;
+    (void)page;
+    if (clean_only()) {
+        int f = vmm.clean[0].head;
+        frame_list_unlink(&vmm.resident, f);
+        return f;
+    }
+    return frame_list_pop(&vmm.resident);
+}
 
-        // Handle I/O completion
-        pthread_mutex_lock(&sched.waiting.lock);
-        PCB* curr = sched.waiting.head;
-        PCB* prev = NULL;
-        while (curr) {
-            if (now - curr->last_run >= IO_TIME) {
-                if (prev) {
-                    prev->next = curr->next;
-                } else {
-                    sched.waiting.head = curr->next;
-                }
-                sched.waiting.count--;
+void list_load(int frame) {
+    vmm.frames[frame].referenced = 1;
+    frame_list_push(&vmm.resident, frame);
+    clean_push(1, frame);
+}
 
-                PCB* ready_proc = curr;
-                curr = curr->next;
-                ready_proc->state = PROC_READY;
-                ready_proc->priority = 0;  // I/O means higher priority
-                ready_proc->wait_time += now - ready_proc->last_run;
+void fifo_access(int frame) {
+    (void)frame;
+}
 
-                pthread_mutex_unlock(&sched.waiting.lock);
-                enqueue(&sched.ready, ready_proc);
-                pthread_mutex_lock(&sched.waiting.lock);
+void list_unmap(int proc_index, int page) {
+    int frame = pte_frame(*page_pte(proc_index, page));
+    if (frame >= 0) frame_list_unlink(&vmm.resident, frame);
+}
 
-                if (scheduler_verbose) {
-                    printf("Scheduler: PID %d I/O completed, priority boosted\n", ready_proc->pid);
-                }
-            } else {
-                prev = curr;
-                curr = curr->next;
-            }
+// Policy: second - FIFO, but a referenced head gets its bit cleared and
+// goes round again
+int second_pick_victim(int proc_index, int page) {
+    (void)proc_index;
+    (void)page;
+    if (clean_only()) {
+        // The same sweep over the clean frames; dirty ones keep their place
+        while (vmm.frames[vmm.clean[0].head].referenced) {
+            int f = vmm.clean[0].head;
+            vmm.frames[f].referenced = 0;
+            frame_list_unlink(&vmm.resident, f);
+            frame_list_push(&vmm.resident, f);
+            clean_touch(1, f);
         }
-        pthread_mutex_unlock(&sched.waiting.lock);
+        int f = vmm.clean[0].head;
+        frame_list_unlink(&vmm.resident, f);
+        return f;
+    }
+    while (vmm.frames[vmm.resident.head].referenced) {
+        int f = frame_list_pop(&vmm.resident);
+        vmm.frames[f].referenced = 0;
+        frame_list_push(&vmm.resident, f);
+    }
+    return frame_list_pop(&vmm.resident);
+}
 
-        // Check for preemption
-        if (sched.running && (now - sched.running->last_run >= TIME_SLICE)) {
-            PCB* preempted = sched.running;
-            sched.running = NULL;
-            preempted->state = PROC_READY;
-            preempted->cpu_time += now - preempted->last_run;
+void reference_access(int frame) {
+    vmm.frames[frame].referenced = 1;
+}
 
-            // Simple I/O simulation
-            if (rand() % 4 == 0) {  // 25% chance
-                preempted->state = PROC_WAITING;
-                preempted->last_run = now;
-                preempted->io_count++;
-                enqueue(&sched.waiting, preempted);
+// Policy: lru - exact recency list, every hit moves the frame to the tail
+void lru_access(int frame) {
+    frame_list_unlink(&vmm.resident, frame);
+    frame_list_push(&vmm.resident, frame);
+    clean_touch(1, frame);
+}
 
-                if (scheduler_verbose) {
-                    printf("Scheduler: PID %d moved to I/O wait\n", preempted->pid);
-                }
-            } else {
-                if (preempted->priority < 2) preempted->priority++;
-                enqueue(&sched.ready, preempted);
+// Policy: clock - sweep a hand over the frame table clearing reference bits.
+// Only called when every frame is in use.
+void clock_reset() {
+    vmm.clock_hand = 0;
+}
 
-                if (scheduler_verbose) {
-                    printf("Scheduler: PID %d preempted, priority now %d\n", 
-                           preempted->pid, preempted->priority);
-                }
-            }
+int clock_pick_victim(int proc_index, int page) {
+    (void)proc_index;
+    (void)page;
+    if (clean_only()) {
+        // The clean frames form a ring of their own, the list head is its hand
+        while (1) {
+            int f = vmm.clean[0].head;
+            if (!vmm.frames[f].referenced) return f;
+            vmm.frames[f].referenced = 0;
+            clean_touch(1, f);
         }
+    }
+    while (1) {
+        int f = vmm.clock_hand;
+        vmm.clock_hand = (vmm.clock_hand + 1) % vmm.num_frames;
+        if (!vmm.frames[f].referenced) return f;
+        vmm.frames[f].referenced = 0;
+    }
+}
 
-        // Age processes
-        pthread_mutex_lock(&sched.ready.lock);
-        curr = sched.ready.head;
-        while (curr) {
-            curr->age_counter++;
-            if (curr->age_counter >= AGING_BOOST) {
-                curr->age_counter = 0;
-                if (curr->priority > 0) {
-                    curr->priority--;
-                    if (scheduler_verbose) {
-                        printf("Scheduler: PID %d aged up to priority %d\n", 
-                               curr->pid, curr->priority);
-                    }
-                }
-            }
-            curr = curr->next;
-        }
-        pthread_mutex_unlock(&sched.ready.lock);
-        
-        // Select next process
-        if (!sched.running) {
-            PCB* next = dequeue_by_priority(&sched.ready);
-            if (next) {
-                sched.running = next;
-                next->state = PROC_RUNNING;
-                next->last_run = now;
-                
-                if (scheduler_verbose) {
-                    printf("Scheduler: Running PID %d (priority %d)\n", 
-                           next->pid, next->priority);
-                }
-            }
-        }
-        usleep(10000);  // 10ms scheduling quantum
+void clock_load(int frame) {
+    vmm.frames[frame].referenced = 1;
+    clean_push(1, frame);
+}
+
+void clock_unmap(int proc_index, int page) {
+    (void)proc_index;
+    (void)page;
+}
+
+// Policy: arc - adaptive replacement cache. T1/T2 hold resident frames seen
+// once/repeatedly; ghosts B1/B2 remember what each evicted and steer arc_p.
+// Ghost lists reuse FrameList with links into vmm.ghosts.
+void ghost_list_push(FrameList* l, int g) {
+    vmm.ghosts[g].prev = l->tail;
+    vmm.ghosts[g].next = -1;
+    if (l->tail >= 0) {
+        vmm.ghosts[l->tail].next = g;
+    } else {
+        l->head = g;
     }
-    return NULL;
+    l->tail = g;
+    l->count++;
 }
 
-void finish_process(PCB* p) {
-    if (sched.running == p) sched.running = NULL;
-    
-    long now = get_time();
-    p->state = PROC_TERMINATED;
-    sched.done_procs++;
-    sched.total_turnaround += now - p->arrival_time;
-    sched.total_wait += p->wait_time;
-    
-    deallocate_process_memory(p->pid);
-    
-    if (scheduler_verbose) {
-        printf("Scheduler: PID %d finished (CPU: %dms, Wait: %dms, I/O: %d)\n", 
-               p->pid, p->cpu_time/1000, p->wait_time/1000, p->io_count);
+void ghost_drop(int g) {
+    ghost_entry_t* ge = &vmm.ghosts[g];
+    FrameList* l = ge->list == 1 ? &vmm.arc_b1 : &vmm.arc_b2;
+    if (ge->prev >= 0) {
+        vmm.ghosts[ge->prev].next = ge->next;
+    } else {
+        l->head = ge->next;
     }
-    
-    free(p);
+    if (ge->next >= 0) {
+        vmm.ghosts[ge->next].prev = ge->prev;
+    } else {
+        l->tail = ge->prev;
+    }
+    l->count--;
+    pte_clear_ghost(page_pte(ge->proc_index, ge->page_number));
+    vmm.processes[ge->proc_index].ghosts--;
+    ge->next = vmm.free_ghost;
+    vmm.free_ghost = g;
 }
 
-// File Management Functions
-void create_file(const char *path, int random_size) {
-    size_t size = random_size ?
-        (rand() % (10 * 1024 * 1024 - 1024)) + 1024 :  // Random 1KB-10MB
-        1024;                                           // Default 1KB
+// Remember the page in frame f on ghost list 1 (B1) or 2 (B2)
+void ghost_add(int list, int f) {
+    if (vmm.free_ghost < 0) ghost_drop(vmm.arc_b2.count ? vmm.arc_b2.head : vmm.arc_b1.head);
+    int g = vmm.free_ghost;
+    vmm.free_ghost = vmm.ghosts[g].next;
+
+    ghost_entry_t* ge = &vmm.ghosts[g];
+    ge->proc_index = vmm.frames[f].proc_index;
+    ge->page_number = vmm.frames[f].page_number;
+    ge->list = list;
+    ghost_list_push(list == 1 ? &vmm.arc_b1 : &vmm.arc_b2, g);
+    pte_set_ghost(page_pte(ge->proc_index, ge->page_number), g);
+    vmm.processes[ge->proc_index].ghosts++;
+}
 
-    printf("Creating %s (%s%zu bytes)\n",
-           path, random_size ? "random " : "", size);
+void arc_reset() {
+    frame_list_init(&vmm.arc_t1);
+    frame_list_init(&vmm.arc_t2);
+    frame_list_init(&vmm.arc_b1);
+    frame_list_init(&vmm.arc_b2);
+    vmm.arc_p = 0;
+    vmm.free_ghost = -1;
+    for (int g = 2 * vmm.num_frames - 1; g >= 0; g--) {
+        vmm.ghosts[g].next = vmm.free_ghost;
+        vmm.free_ghost = g;
+    }
+}
 
-    FILE *file = fopen(path, "w");
-    if (!file) {
-        perror("Failed to create file");
-        return;
+// A ghost hit means the list it came from was too small: adapt arc_p
+void arc_miss(int proc_index, int page) {
+    int g = pte_ghost(*page_pte(proc_index, page));
+    if (g < 0) return;
+    int b1 = vmm.arc_b1.count, b2 = vmm.arc_b2.count;
+    if (vmm.ghosts[g].list == 1) {
+        int delta = b2 > b1 ? b2 / b1 : 1;
+        vmm.arc_p = vmm.arc_p + delta > vmm.num_frames ? vmm.num_frames : vmm.arc_p + delta;
+    } else {
+        int delta = b1 > b2 ? b1 / b2 : 1;
+        vmm.arc_p = vmm.arc_p - delta < 0 ? 0 : vmm.arc_p - delta;
+    }
+}
+
+// Unlink the LRU frame of T1 or T2, or its LRU clean frame
+int arc_pop(int list, int clean) {
+    FrameList* l = list == 1 ? &vmm.arc_t1 : &vmm.arc_t2;
+    int f = clean ? vmm.clean[list - 1].head : l->head;
+    frame_list_unlink(l, f);
+    return f;
+}
+
+int arc_pick_victim(int proc_index, int page) {
+    int g = pte_ghost(*page_pte(proc_index, page));
+    int in_b2 = g >= 0 && vmm.ghosts[g].list == 2;
+    int clean = clean_only();
+    FrameList* t1 = &vmm.arc_t1;
+
+    // A brand-new page with L1 (T1 + B1) full: if T1 alone fills the
+    // cache, drop its LRU outright rather than remembering it
+    if (g < 0 && t1->count + vmm.arc_b1.count >= vmm.num_frames) {
+        if (t1->count >= vmm.num_frames) return arc_pop(1, clean);
+        if (vmm.arc_b1.count) ghost_drop(vmm.arc_b1.head);
     }
 
-    unsigned char *data = malloc(size);
-    if (!data) {
-        perror("Memory allocation failed");
-        fclose(file);
+    int list = t1->count > 0 && (t1->count > vmm.arc_p || (in_b2 && t1->count == vmm.arc_p) ||
+                                 vmm.arc_t2.count == 0) ? 1 : 2;
+    // Only clean frames may go: take the other list's if this one has none
+    if (clean && vmm.clean[list - 1].count == 0) list = 3 - list;
+    int f = arc_pop(list, clean);
+    ghost_add(list, f);
+    return f;
+}
+
+void arc_load(int frame) {
+    frame_entry_t* fr = &vmm.frames[frame];
+    int g = pte_ghost(*page_pte(fr->proc_index, fr->page_number));
+    if (g >= 0) {
+        ghost_drop(g);
+        fr->list = 2;
+        frame_list_push(&vmm.arc_t2, frame);
+        clean_push(2, frame);
         return;
     }
 
-    for (size_t i = 0; i < size; i++) {
-        data[i] = rand() % 256;
+    fr->list = 1;
+    frame_list_push(&vmm.arc_t1, frame);
+    clean_push(1, frame);
+    while (vmm.arc_b1.count && vmm.arc_t1.count + vmm.arc_b1.count > vmm.num_frames) {
+        ghost_drop(vmm.arc_b1.head);
     }
+    while (vmm.arc_b2.count && vmm.arc_t1.count + vmm.arc_t2.count +
+           vmm.arc_b1.count + vmm.arc_b2.count > 2 * vmm.num_frames) {
+        ghost_drop(vmm.arc_b2.head);
+    }
+}
 
-    fwrite(data, 1, size, file);
-    free(data);
-    fclose(file);
+void arc_access(int frame) {
+    frame_entry_t* fr = &vmm.frames[frame];
+    frame_list_unlink(fr->list == 1 ? &vmm.arc_t1 : &vmm.arc_t2, frame);
+    fr->list = 2;
+    frame_list_push(&vmm.arc_t2, frame);
+    clean_touch(2, frame);
 }
 
-void modify_file(const char *path) {
-    printf("Modifying %s\n", path);
-    FILE *file = fopen(path, "a");
-    if (file == NULL) {
-        perror("Failed to open file for modification");
-        return;
+void arc_unmap(int proc_index, int page) {
+    pte_t pte = *page_pte(proc_index, page);
+    int frame = pte_frame(pte);
+    if (frame >= 0) {
+        frame_entry_t* fr = &vmm.frames[frame];
+        frame_list_unlink(fr->list == 1 ? &vmm.arc_t1 : &vmm.arc_t2, frame);
     }
-    fprintf(file, "Appended content to the file.\n");
-    fclose(file);
+    if (pte_ghost(pte) >= 0) ghost_drop(pte_ghost(pte));
 }
 
-void delete_file(const char *path) {
-    printf("Deleting %s\n", path);
-    if (remove(path) != 0) {
-        perror("Failed to delete file");
+const ReplacementPolicy repl_policies[] = {
+    {"fifo", "First In First Out", fifo_reset, NULL, list_pick_victim, list_load,
+     fifo_access, list_unmap},
+    {"second", "Second Chance FIFO", fifo_reset, NULL, second_pick_victim, list_load,
+     reference_access, list_unmap},
+    {"clock", "CLOCK (reference bits)", clock_reset, NULL, clock_pick_victim, clock_load,
+     reference_access, clock_unmap},
+    {"lru", "Least Recently Used", fifo_reset, NULL, list_pick_victim, list_load,
+     lru_access, list_unmap},
+    {"arc", "Adaptive Replacement Cache", arc_reset, arc_miss, arc_pick_victim, arc_load,
+     arc_access, arc_unmap},
+};
+#define NUM_REPL_POLICIES (int)(sizeof(repl_policies) / sizeof(repl_policies[0]))
+
+const ReplacementPolicy* repl_policy = &repl_policies[0];
+
+// Parse a count with an optional K/M/G suffix (powers of 1024), e.g. "2M".
+// Returns -1 if the string is not a valid non-negative size.
+long long parse_size(const char* str) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(str, &end, 10);
+    if (errno || end == str || value < 0) return -1;
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
     }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end || value > (LLONG_MAX >> shift)) return -1;
+    return value << shift;
 }
 
-void get_file_info(const char *path, int detailed) {
+char* frame_memory(int frame_index) {
+    return vmm.memory + (size_t)frame_index * vmm.page_size;
+}
+
+// Swap device: slot i lives at offset i * page_size of an unlinked file
+
+// Move one page between buf and a slot. Returns 0 or an errno.
+int swap_transfer(int is_write, int slot, char* buf) {
+    off_t offset = (off_t)slot * vmm.page_size;
+    size_t done = 0;
+    while (done < (size_t)vmm.page_size) {
+        ssize_t n = is_write
+            ? pwrite(swap_device.fd, buf + done, vmm.page_size - done, offset + done)
+            : pread(swap_device.fd, buf + done, vmm.page_size - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        if (n == 0) {
+            // Never-written tail of the sparse file reads as zeros
+            memset(buf + done, 0, vmm.page_size - done);
+            break;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+void* swap_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&swap_device.lock);
+    while (1) {
+        while (!swap_device.head && !swap_device.stop) {
+            pthread_cond_wait(&swap_device.work_cond, &swap_device.lock);
+        }
+        SwapRequest* req = swap_device.head;
+        if (!req) break;  // Stopping and drained
+        swap_device.head = req->next;
+        if (!swap_device.head) swap_device.tail = NULL;
+        pthread_mutex_unlock(&swap_device.lock);
+
+        int error = swap_transfer(1, req->slot, req->buf);
+
+        pthread_mutex_lock(&swap_device.lock);
+        req->error = error;
+        req->done = 1;
+        if (error) swap_device.errors++;
+        swap_device.writes++;
+        swap_device.write_us += get_time() - req->submitted;
+        swap_device.writes_in_flight--;
+        req->next = swap_device.completed;
+        swap_device.completed = req;
+        pthread_cond_broadcast(&swap_device.done_cond);
+    }
+    pthread_mutex_unlock(&swap_device.lock);
+    return NULL;
+}
+
+void swap_submit(SwapRequest* req) {
+    req->done = 0;
+    req->error = 0;
+    req->next = NULL;
+    pthread_mutex_lock(&swap_device.lock);
+    req->submitted = get_time();
+    // Queue depth limit: eviction stalls only when the device is saturated
+    while (swap_device.writes_in_flight >= SWAP_IO_DEPTH) {
+        pthread_cond_wait(&swap_device.done_cond, &swap_device.lock);
+    }
+    swap_device.writes_in_flight++;
+    if (swap_device.tail) swap_device.tail->next = req;
+    else swap_device.head = req;
+    swap_device.tail = req;
+    pthread_cond_signal(&swap_device.work_cond);
+    pthread_mutex_unlock(&swap_device.lock);
+}
+
+void swap_wait(SwapRequest* req) {
+    pthread_mutex_lock(&swap_device.lock);
+    while (!req->done) pthread_cond_wait(&swap_device.done_cond, &swap_device.lock);
+    pthread_mutex_unlock(&swap_device.lock);
+}
+
+// Free finished write-backs. Caller holds vmm.lock.
+void swap_reap_locked() {
+    pthread_mutex_lock(&swap_device.lock);
+    SwapRequest* req = swap_device.completed;
+    swap_device.completed = NULL;
+    pthread_mutex_unlock(&swap_device.lock);
+
+    while (req) {
+        SwapRequest* next = req->next;
+        if (vmm.swap_pending[req->slot] == req) vmm.swap_pending[req->slot] = NULL;
+        if (req->error) {
+            printf("VMM: Swap write to slot %d failed: %s\n", req->slot, strerror(req->error));
+        }
+        free(req->buf);
+        free(req);
+        req = next;
+    }
+}
+
+int start_swap_device() {
+    const char* dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/lope-swap-XXXXXX", dir ? dir : "/tmp");
+    swap_device.fd = mkostemp(path, O_CLOEXEC);
+    if (swap_device.fd < 0) return -1;
+    unlink(path);
+    // Sparse: blocks are only allocated as slots are written
+    if (ftruncate(swap_device.fd, (off_t)vmm.swap_slots * vmm.page_size) != 0) {
+        close(swap_device.fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&swap_device.lock, NULL);
+    pthread_cond_init(&swap_device.work_cond, NULL);
+    pthread_cond_init(&swap_device.done_cond, NULL);
+    swap_device.head = swap_device.tail = swap_device.completed = NULL;
+    swap_device.writes_in_flight = 0;
+    swap_device.stop = 0;
+    swap_device.reads = swap_device.writes = swap_device.cached_reads = swap_device.errors = 0;
+    swap_device.read_wait_us = swap_device.write_us = 0;
+    swap_device.owner = getpid();
+    for (int i = 0; i < SWAP_IO_WORKERS; i++) {
+        pthread_create(&swap_device.workers[i], NULL, swap_worker, NULL);
+    }
+    swap_device.started = 1;
+    return 0;
+}
+
+// Drain outstanding write-backs, then stop the workers and drop the file
+void stop_swap_device() {
+    if (!swap_device.started || swap_device.owner != getpid()) return;
+    pthread_mutex_lock(&swap_device.lock);
+    swap_device.stop = 1;
+    pthread_cond_broadcast(&swap_device.work_cond);
+    pthread_mutex_unlock(&swap_device.lock);
+    for (int i = 0; i < SWAP_IO_WORKERS; i++) {
+        pthread_join(swap_device.workers[i], NULL);
+    }
+    swap_reap_locked();
+    close(swap_device.fd);
+    swap_device.started = 0;
+}
+
+void init_frame(int f) {
+    vmm.frames[f].is_used = 0;
+    vmm.frames[f].process_id = -1;
+    vmm.frames[f].proc_index = -1;
+    vmm.frames[f].page_number = -1;
+    vmm.frames[f].load_time = 0;
+    vmm.frames[f].referenced = 0;
+    vmm.frames[f].list = 0;
+    vmm.frames[f].prev = -1;
+    vmm.frames[f].next = -1;
+    vmm.frames[f].owner_prev = -1;
+    vmm.frames[f].owner_next = -1;
+    vmm.frames[f].clean = 0;
+    vmm.frames[f].clean_prev = -1;
+    vmm.frames[f].clean_next = -1;
+    vmm.frames[f].last_use = 0;
+}
+
+// Size every VMM table from the given geometry. Returns -1 if out of memory.
+int init_vmm(int page_size, int num_frames, int virtual_pages, int swap_slots, int max_processes) {
+    if (vmm_verbose) {
+        printf("Initializing VMM: %d frames, %d KB pages\n", 
+               num_frames, page_size/1024);
+    }
+
+    vmm.page_size = page_size;
+    vmm.num_frames = num_frames;
+    vmm.virtual_pages = virtual_pages;
+    vmm.swap_slots = swap_slots;
+    vmm.max_processes = max_processes;
+    vmm.pt_levels = 1;
+    while (vmm.pt_levels * PT_LEVEL_BITS < 31 && (1L << (vmm.pt_levels * PT_LEVEL_BITS)) < virtual_pages) {
+        vmm.pt_levels++;
+    }
+    vmm.pt_nodes = 0;
+    vmm.frames = malloc((size_t)num_frames * sizeof(frame_entry_t));
+    vmm.free_frames = malloc(BITMAP_WORDS(num_frames) * sizeof(uint64_t));
+    vmm.ghosts = malloc(2 * (size_t)num_frames * sizeof(ghost_entry_t));
+    vmm.processes = calloc(max_processes, sizeof(process_info_t));
+    vmm.free_slots = malloc(max_processes * sizeof(int));
+    vmm.free_swap = malloc(BITMAP_WORDS(swap_slots) * sizeof(uint64_t));
+    vmm.swap_pending = calloc(swap_slots, sizeof(SwapRequest*));
+    if (!vmm.frames || !vmm.free_frames || !vmm.ghosts || !vmm.processes ||
+        !vmm.free_slots || !vmm.free_swap || !vmm.swap_pending) {
+        return -1;
+    }
+
+    // Reserve address space only; pages are backed as frames are first touched
+    vmm.memory_size = (size_t)num_frames * page_size;
+    vmm.memory = mmap(NULL, vmm.memory_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vmm.memory == MAP_FAILED) {
+        vmm.memory = NULL;
+        return -1;
+    }
+    if (start_swap_device() != 0) return -1;
+
+    for (int i = 0; i < num_frames; i++) {
+        init_frame(i);
+    }
+
+    // Push slots in reverse so slot 0 is handed out first
+    vmm.num_free_slots = 0;
+    for (int i = max_processes - 1; i >= 0; i--) {
+        vmm.processes[i].pid = -1;
+        vmm.processes[i].page_table = NULL;
+        vmm.free_slots[vmm.num_free_slots++] = i;
+    }
+
+    bitmap_fill(vmm.free_frames, num_frames);
+    bitmap_fill(vmm.free_swap, swap_slots);
+    vmm.swap_free = swap_slots;
+
+    vmm.next_frame_time = 1;
+    vmm.num_processes = 0;
+    vmm.total_accesses = 0;
+    vmm.total_faults = 0;
+    vmm.failed_faults = 0;
+    vmm.evictions = 0;
+    vmm.swap_writes = 0;
+    vmm.swap_drops = 0;
+    for (int s = 0; s < TLB_SETS; s++) {
+        for (int w = 0; w < TLB_WAYS; w++) vmm.tlb[s][w].asid = -1;
+    }
+    vmm.tlb_clock = 0;
+    vmm.tlb_hits = vmm.tlb_misses = vmm.tlb_shootdowns = vmm.tlb_flushes = 0;
+    vmm.pff = 0;
+    vmm.total_quota = 0;
+    vmm.use_clock = 0;
+    vmm.thrash_suspends = 0;
+    clean_reset();
+    repl_policy->reset();
+    pthread_mutex_init(&vmm.lock, NULL);
+    return 0;
+}
+
+void cleanup_vmm() {
+    stop_swap_device();
+    if (vmm.memory) munmap(vmm.memory, vmm.memory_size);
+    vmm.memory = NULL;
+    free(vmm.swap_pending);
+    vmm.swap_pending = NULL;
+    for (int i = 0; vmm.processes && i < vmm.max_processes; i++) {
+        if (vmm.processes[i].pid != -1) pt_free(vmm.processes[i].page_table, vmm.pt_levels - 1);
+    }
+    free(vmm.frames);
+    free(vmm.free_frames);
+    free(vmm.ghosts);
+    free(vmm.processes);
+    free(vmm.free_slots);
+    free(vmm.free_swap);
+    vmm.frames = NULL;
+    vmm.processes = NULL;
+}
+
+// Returns the process slot, or -1 if there is no room
+int allocate_process_memory(int pid, long memory_size) {
+    long pages_needed = (memory_size + vmm.page_size - 1) / vmm.page_size;
+    pthread_mutex_lock(&vmm.lock);
+    if (vmm.num_free_slots == 0 || pages_needed > vmm.virtual_pages) {
+        pthread_mutex_unlock(&vmm.lock);
+        return -1;
+    }
+
+    // Nothing is loaded, nor any page table built, until the first access
+    int proc_index = vmm.free_slots[--vmm.num_free_slots];
+    process_info_t *proc = &vmm.processes[proc_index];
+    proc->pid = pid;
+    proc->memory_size = memory_size;
+    proc->num_pages = pages_needed;
+    proc->page_table = NULL;
+    proc->pt_nodes = 0;
+    proc->last_page = 0;
+    proc->accesses = 0;
+    proc->faults = 0;
+    proc->resident = 0;
+    proc->resident_head = -1;
+    proc->swapped = 0;
+    proc->ghosts = 0;
+    proc->quota = pages_needed < PFF_INITIAL_QUOTA ? (int)pages_needed : PFF_INITIAL_QUOTA;
+    if (proc->quota < 1) proc->quota = 1;
+    proc->window_accesses = 0;
+    proc->window_faults = 0;
+    proc->fault_rate = 0;
+    proc->thrashing = 0;
+    vmm.total_quota += proc->quota;
+    vmm.num_processes++;
+
+    if (vmm_verbose) {
+        printf("VMM: Allocated %ld KB (%ld pages) for PID %d\n", 
+               memory_size/1024, pages_needed, pid);
+    }
+    pthread_mutex_unlock(&vmm.lock);
+    return proc_index;
+}
+
+// TLB helpers below run with vmm.lock held
+
+tlb_entry_t* tlb_set(int asid, int page) {
+    return vmm.tlb[(page ^ (asid * 7)) & (TLB_SETS - 1)];
+}
+
+tlb_entry_t* tlb_lookup(int asid, int page) {
+    tlb_entry_t* set = tlb_set(asid, page);
+    for (int w = 0; w < TLB_WAYS; w++) {
+        if (set[w].asid == asid && set[w].page == page) {
+            set[w].last_use = ++vmm.tlb_clock;
+            return &set[w];
+        }
+    }
+    return NULL;
+}
+
+// Install a translation over an invalid or the least recently used way
+tlb_entry_t* tlb_fill(int asid, int page, int frame, int dirty) {
+    tlb_entry_t* set = tlb_set(asid, page);
+    tlb_entry_t* victim = &set[0];
+    for (int w = 0; w < TLB_WAYS && victim->asid != -1; w++) {
+        if (set[w].asid == -1 || set[w].last_use < victim->last_use) victim = &set[w];
+    }
+    victim->asid = asid;
+    victim->page = page;
+    victim->frame = frame;
+    victim->dirty = dirty;
+    victim->last_use = ++vmm.tlb_clock;
+    return victim;
+}
+
+// Shootdown: the page lost its frame
+void tlb_invalidate(int asid, int page) {
+    tlb_entry_t* set = tlb_set(asid, page);
+    for (int w = 0; w < TLB_WAYS; w++) {
+        if (set[w].asid == asid && set[w].page == page) {
+            set[w].asid = -1;
+            vmm.tlb_shootdowns++;
+        }
+    }
+}
+
+// The slot's ASID is about to be reused by another process
+void tlb_flush_asid(int asid) {
+    for (int s = 0; s < TLB_SETS; s++) {
+        for (int w = 0; w < TLB_WAYS; w++) {
+            if (vmm.tlb[s][w].asid == asid) vmm.tlb[s][w].asid = -1;
+        }
+    }
+    vmm.tlb_flushes++;
+}
+
+// Frame and swap helpers below run with vmm.lock held
+
+// Detach a resident frame from its page and owner and mark it free
+void release_frame(int frame_index) {
+    frame_entry_t *frame = &vmm.frames[frame_index];
+    process_info_t *proc = &vmm.processes[frame->proc_index];
+
+    pte_unmap(page_pte(frame->proc_index, frame->page_number));
+
+    if (frame->owner_prev >= 0) {
+        vmm.frames[frame->owner_prev].owner_next = frame->owner_next;
+    } else {
+        proc->resident_head = frame->owner_next;
+    }
+    if (frame->owner_next >= 0) vmm.frames[frame->owner_next].owner_prev = frame->owner_prev;
+    proc->resident--;
+    clean_unlink(frame_index);
+
+    frame->is_used = 0;
+    frame->process_id = -1;
+    frame->proc_index = -1;
+    frame->page_number = -1;
+    frame->load_time = 0;
+    frame->owner_prev = -1;
+    frame->owner_next = -1;
+    bitmap_set(vmm.free_frames, frame_index);
+}
+
+// Give back the swap slot and ghost of one page of an exiting process
+void release_pte(int proc_index, int page, pte_t* pte) {
+    if (pte_ghost(*pte) >= 0) repl_policy->on_unmap(proc_index, page);
+    if (pte_swap_slot(*pte) >= 0) {
+        bitmap_set(vmm.free_swap, pte_swap_slot(*pte));
+        vmm.swap_free++;
+        pte_clear_swap(pte);
+        vmm.processes[proc_index].swapped--;
+    }
+}
+
+void deallocate_process_memory(int proc_index) {
+    pthread_mutex_lock(&vmm.lock);
+    process_info_t *proc = &vmm.processes[proc_index];
+    int pid = proc->pid;
+
+    tlb_flush_asid(proc_index);
+
+    // Resident frames via the process's own list
+    while (proc->resident_head >= 0) {
+        int f = proc->resident_head;
+        repl_policy->on_unmap(proc_index, vmm.frames[f].page_number);
+        release_frame(f);
+    }
+
+    // Swap slots and ghosts need a table walk, but only if there are any
+    if (proc->swapped || proc->ghosts) {
+        pt_walk(proc_index, proc->page_table, vmm.pt_levels - 1, 0, release_pte);
+    }
+    pt_free(proc->page_table, vmm.pt_levels - 1);
+    vmm.pt_nodes -= proc->pt_nodes;
+
+    vmm.total_quota -= proc->quota;
+    proc->pid = -1;
+    proc->page_table = NULL;
+    vmm.free_slots[vmm.num_free_slots++] = proc_index;
+    vmm.num_processes--;
+
+    if (vmm_verbose) {
+        printf("VMM: Deallocated memory for PID %d (%ld faults / %ld accesses)\n",
+               pid, proc->faults, proc->accesses);
+    }
+    pthread_mutex_unlock(&vmm.lock);
+}
+
+int find_free_frame() {
+    return bitmap_first_set(vmm.free_frames, vmm.num_frames);
+}
+
+// Read a page back from swap, synchronously and with vmm.lock held: handing
+// the read to the worker pool would not let anyone else in any sooner
+int swap_in_page(int swap_slot, int frame_index) {
+    if (vmm_verbose) {
+        printf("VMM: Reading page from swap slot %d into frame %d\n", swap_slot, frame_index);
+    }
+
+    swap_reap_locked();
+    SwapRequest* pending = vmm.swap_pending[swap_slot];
+    if (pending) {
+        // The write-back is still ours until reaped, so its copy is current
+        memcpy(frame_memory(frame_index), pending->buf, vmm.page_size);
+        pthread_mutex_lock(&swap_device.lock);
+        swap_device.cached_reads++;
+        pthread_mutex_unlock(&swap_device.lock);
+        return 0;
+    }
+
+    long start = get_time();
+    int error = swap_transfer(0, swap_slot, frame_memory(frame_index));
+    pthread_mutex_lock(&swap_device.lock);
+    swap_device.reads++;
+    swap_device.read_wait_us += get_time() - start;
+    if (error) swap_device.errors++;
+    pthread_mutex_unlock(&swap_device.lock);
+    if (error) {
+        printf("VMM: Swap read from slot %d failed: %s\n", swap_slot, strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+// Queue a copy of the frame for writing; the frame is free to reuse at once
+void swap_write_page(int swap_slot, int frame_index) {
+    swap_reap_locked();
+    if (vmm.swap_pending[swap_slot]) {
+        // An older write to this (since freed) slot must not land after ours
+        swap_wait(vmm.swap_pending[swap_slot]);
+    }
+
+    SwapRequest* req = malloc(sizeof(SwapRequest));
+    char* buf = malloc(vmm.page_size);
+    if (!req || !buf) {
+        // No memory for a copy: write synchronously from the frame instead
+        free(req);
+        free(buf);
+        if (pwrite(swap_device.fd, frame_memory(frame_index), vmm.page_size,
+                   (off_t)swap_slot * vmm.page_size) != vmm.page_size) {
+            perror("VMM: swap write");
+        }
+        vmm.swap_pending[swap_slot] = NULL;
+        return;
+    }
+    memcpy(buf, frame_memory(frame_index), vmm.page_size);
+    req->slot = swap_slot;
+    req->buf = buf;
+    vmm.swap_pending[swap_slot] = req;
+    swap_submit(req);
+}
+
+void swap_out_page(int frame_index) {
+    frame_entry_t *frame = &vmm.frames[frame_index];
+    process_info_t *proc = &vmm.processes[frame->proc_index];
+    pte_t *pte = page_pte(frame->proc_index, frame->page_number);
+
+    // Only dirty pages need writing back; a clean page's swap copy is current
+    if (*pte & PTE_DIRTY) {
+        int swap_slot = bitmap_first_set(vmm.free_swap, vmm.swap_slots);
+        if (swap_slot != -1) {
+            bitmap_clear(vmm.free_swap, swap_slot);
+            vmm.swap_free--;
+            pte_set_swap(pte, swap_slot);
+            proc->swapped++;
+            vmm.swap_writes++;
+            swap_write_page(swap_slot, frame_index);
+            if (vmm_verbose) printf("VMM: Dirty page written to swap slot %d\n", swap_slot);
+        } else {
+            vmm.swap_drops++;
+            if (vmm_verbose) printf("VMM: Swap full, dirty page of PID %d dropped\n", proc->pid);
+        }
+        *pte &= ~PTE_DIRTY;
+    }
+
+    tlb_invalidate(frame->proc_index, frame->page_number);
+    release_frame(frame_index);
+}
+
+// Make room for virtual_page of proc_index by evicting the policy's victim
+int evict_page(int proc_index, int virtual_page) {
+    int victim = repl_policy->pick_victim(proc_index, virtual_page);
+
+    if (vmm_verbose) {
+        printf("VMM: Evicting frame %d (PID=%d, Page=%d) [%s]\n", 
+               victim, 
+               vmm.frames[victim].process_id,
+               vmm.frames[victim].page_number, repl_policy->name);
+    }
+
+    vmm.evictions++;
+    swap_out_page(victim);
+    return victim;
+}
+
+// Evict a specific frame, bypassing the policy's choice
+void evict_frame(int frame_index) {
+    repl_policy->on_unmap(vmm.frames[frame_index].proc_index, vmm.frames[frame_index].page_number);
+    vmm.evictions++;
+    swap_out_page(frame_index);
+}
+
+// Local replacement: the process's least recently used frame, or its least
+// recently used clean one when swap is full
+int evict_local(int proc_index) {
+    int victim = vmm.processes[proc_index].resident_head, clean = -1;
+    for (int f = victim; f >= 0; f = vmm.frames[f].owner_next) {
+        if (vmm.frames[f].last_use < vmm.frames[victim].last_use) victim = f;
+        if (vmm.frames[f].clean && (clean < 0 || vmm.frames[f].last_use < vmm.frames[clean].last_use)) {
+            clean = f;
+        }
+    }
+    if (vmm.swap_free == 0 && clean >= 0) victim = clean;
+    if (vmm_verbose) {
+        printf("VMM: PID %d at its quota of %d frames, evicting its frame %d\n",
+               vmm.processes[proc_index].pid, vmm.processes[proc_index].quota, victim);
+    }
+    evict_frame(victim);
+    return victim;
+}
+
+// Page-fault-frequency control, once per PFF_WINDOW accesses: a process
+// faulting often gets more frames while any are unallotted, one faulting
+// rarely gives frames back. A process that wants frames when none are left
+// is marked thrashing for the scheduler to act on.
+void pff_sample(int proc_index) {
+    process_info_t *proc = &vmm.processes[proc_index];
+    proc->fault_rate = proc->window_faults * 100 / proc->window_accesses;
+    proc->window_accesses = 0;
+    proc->window_faults = 0;
+
+    if (proc->fault_rate > PFF_HIGH) {
+        long grant = vmm.num_frames - vmm.total_quota;
+        if (grant > PFF_GROW) grant = PFF_GROW;
+        if (grant > proc->num_pages - proc->quota) grant = proc->num_pages - proc->quota;
+        if (grant > 0) {
+            proc->quota += grant;
+            vmm.total_quota += grant;
+            proc->thrashing = 0;
+        } else {
+            proc->thrashing = proc->quota < proc->num_pages;
+        }
+    } else {
+        proc->thrashing = 0;
+        if (proc->fault_rate < PFF_LOW && proc->quota > PFF_MIN_QUOTA) {
+            proc->quota--;
+            vmm.total_quota--;
+            while (proc->resident > proc->quota) evict_local(proc_index);
+        }
+    }
+}
+
+// Load virtual_page of the process in proc_index into a frame
+int handle_page_fault(int proc_index, int virtual_page) {
+    process_info_t *proc = &vmm.processes[proc_index];
+    if (vmm_verbose) {
+        printf("VMM: Page fault - PID=%d, Page=%d\n", proc->pid, virtual_page);
+    }
+
+    if (virtual_page >= proc->num_pages) {
+        if (vmm_verbose) printf("VMM Error: Segmentation fault - invalid page access\n");
+        return -1;
+    }
+
+    pte_t *pte = pte_lookup(proc_index, virtual_page, 1);
+    if (!pte) {
+        printf("VMM Error: Out of memory for page tables\n");
+        return -1;
+    }
+    if (repl_policy->on_miss) repl_policy->on_miss(proc_index, virtual_page);
+
+    int frame_index;
+    if (vmm.pff && proc->resident > 0 && proc->resident >= proc->quota) {
+        frame_index = evict_local(proc_index);
+    } else if ((frame_index = find_free_frame()) == -1) {
+        frame_index = evict_page(proc_index, virtual_page);
+    }
+
+    // The slot stays allocated while the page is clean, so evicting it
+    // again costs no write
+    if (*pte & PTE_SWAPPED) {
+        if (swap_in_page(pte_swap_slot(*pte), frame_index) != 0) {
+            // The frame was never mapped, so it is still free; the PTE keeps
+            // its slot and the next access retries the read
+            vmm.failed_faults++;
+            return -1;
+        }
+    } else {
+        memset(frame_memory(frame_index), 0, vmm.page_size);
+    }
+    proc->resident++;
+
+    frame_entry_t *frame = &vmm.frames[frame_index];
+    frame->owner_prev = -1;
+    frame->owner_next = proc->resident_head;
+    if (proc->resident_head >= 0) vmm.frames[proc->resident_head].owner_prev = frame_index;
+    proc->resident_head = frame_index;
+
+    vmm.frames[frame_index].is_used = 1;
+    bitmap_clear(vmm.free_frames, frame_index);
+    vmm.frames[frame_index].process_id = proc->pid;
+    vmm.frames[frame_index].proc_index = proc_index;
+    vmm.frames[frame_index].page_number = virtual_page;
+    vmm.frames[frame_index].load_time = vmm.next_frame_time++;
+    // ARC consults (and drops) the page's ghost here, so map only afterwards
+    repl_policy->on_load(frame_index);
+    pte_map(pte, frame_index);
+    return 0;
+}
+
+// One memory reference; returns 1 on a hit, 0 after a serviced fault, -1 on error
+int vmm_access_locked(int proc_index, int virtual_page, int is_write) {
+    process_info_t *proc = &vmm.processes[proc_index];
+    pte_t *pte = NULL;
+    int hit = 1;
+
+    proc->accesses++;
+    vmm.total_accesses++;
+    // Only a TLB miss walks the page table
+    tlb_entry_t *tlb = tlb_lookup(proc_index, virtual_page);
+    if (tlb) {
+        vmm.tlb_hits++;
+    } else {
+        vmm.tlb_misses++;
+        pte = page_pte(proc_index, virtual_page);
+        hit = pte && (*pte & PTE_PRESENT);
+        if (!hit) {
+            proc->faults++;
+            vmm.total_faults++;
+            if (handle_page_fault(proc_index, virtual_page) != 0) return -1;
+            pte = page_pte(proc_index, virtual_page);
+        }
+        *pte |= PTE_ACCESSED;
+        tlb = tlb_fill(proc_index, virtual_page, pte_frame(*pte), (*pte & PTE_DIRTY) != 0);
+    }
+    if (hit) repl_policy->on_access(tlb->frame);
+    vmm.frames[tlb->frame].last_use = ++vmm.use_clock;
+
+    if (is_write) {
+        if (!tlb->dirty) {
+            // First write through this translation: update the PTE
+            if (!pte) pte = page_pte(proc_index, virtual_page);
+            if (*pte & PTE_SWAPPED) {
+                // The swap copy is stale now
+                bitmap_set(vmm.free_swap, pte_swap_slot(*pte));
+                vmm.swap_free++;
+                pte_clear_swap(pte);
+                proc->swapped--;
+            }
+            *pte |= PTE_DIRTY;
+            clean_unlink(tlb->frame);
+            tlb->dirty = 1;
+        }
+        ((uint64_t*)frame_memory(tlb->frame))[0]++;
+    }
+    proc->last_page = virtual_page;
+
+    if (!hit) proc->window_faults++;
+    if (vmm.pff && ++proc->window_accesses >= PFF_WINDOW) pff_sample(proc_index);
+    return hit;
+}
+
+void forget_ghost(int proc_index, int page, pte_t* pte) {
+    (void)proc_index;
+    (void)page;
+    pte_clear_ghost(pte);
+}
+
+int compare_load_time(const void* a, const void* b) {
+    return vmm.frames[*(const int*)a].load_time - vmm.frames[*(const int*)b].load_time;
+}
+
+// Forget the replacement policy's state (ARC ghosts included) and replay
+// the resident frames into it in load order. Caller holds vmm.lock.
+int rebuild_replacement_locked() {
+    int* order = malloc((size_t)vmm.num_frames * sizeof(int));
+    int n = 0;
+    if (!order) return -1;
+
+    for (int i = 0; i < vmm.max_processes; i++) {
+        if (vmm.processes[i].pid == -1 || vmm.processes[i].ghosts == 0) continue;
+        pt_walk(i, vmm.processes[i].page_table, vmm.pt_levels - 1, 0, forget_ghost);
+        vmm.processes[i].ghosts = 0;
+    }
+    for (int f = 0; f < vmm.num_frames; f++) {
+        if (vmm.frames[f].is_used) order[n++] = f;
+    }
+    qsort(order, n, sizeof(int), compare_load_time);
+
+    clean_reset();
+    repl_policy->reset();
+    for (int i = 0; i < n; i++) {
+        repl_policy->on_load(order[i]);
+        if (*page_pte(vmm.frames[order[i]].proc_index, vmm.frames[order[i]].page_number) & PTE_DIRTY) {
+            clean_unlink(order[i]);
+        }
+    }
+    free(order);
+    return 0;
+}
+
+void set_replacement_policy(const ReplacementPolicy* policy) {
+    pthread_mutex_lock(&vmm.lock);
+    const ReplacementPolicy* old = repl_policy;
+    repl_policy = policy;
+    if (rebuild_replacement_locked() != 0) {
+        repl_policy = old;
+        pthread_mutex_unlock(&vmm.lock);
+        perror("Failed to switch replacement policy");
+        return;
+    }
+
+    // Fault counters are per policy
+    vmm.total_accesses = 0;
+    vmm.total_faults = 0;
+    vmm.failed_faults = 0;
+    vmm.evictions = 0;
+    vmm.swap_writes = 0;
+    vmm.swap_drops = 0;
+    vmm.tlb_hits = vmm.tlb_misses = vmm.tlb_shootdowns = vmm.tlb_flushes = 0;
+    pthread_mutex_lock(&swap_device.lock);
+    swap_device.reads = swap_device.writes = swap_device.cached_reads = swap_device.errors = 0;
+    swap_device.read_wait_us = swap_device.write_us = 0;
+    pthread_mutex_unlock(&swap_device.lock);
+    pthread_mutex_unlock(&vmm.lock);
+    printf("VMM replacement policy: %s (%s)\n", policy->name, policy->description);
+}
+
+// Change the number of physical frames at runtime. Shrinking first evicts
+// (with write-back) every page held by a frame that goes away.
+int vmm_resize(int num_frames) {
+    pthread_mutex_lock(&vmm.lock);
+    int old_frames = vmm.num_frames;
+    for (int f = num_frames; f < old_frames; f++) {
+        if (vmm.frames[f].is_used) {
+            vmm.evictions++;
+            swap_out_page(f);
+        }
+    }
+
+    frame_entry_t *frames = realloc(vmm.frames, (size_t)num_frames * sizeof(frame_entry_t));
+    if (frames) vmm.frames = frames;
+    uint64_t *free_frames = realloc(vmm.free_frames, BITMAP_WORDS(num_frames) * sizeof(uint64_t));
+    if (free_frames) vmm.free_frames = free_frames;
+    ghost_entry_t *ghosts = realloc(vmm.ghosts, 2 * (size_t)num_frames * sizeof(ghost_entry_t));
+    if (ghosts) vmm.ghosts = ghosts;
+    size_t memory_size = (size_t)num_frames * vmm.page_size;
+    char *memory = mremap(vmm.memory, vmm.memory_size, memory_size, MREMAP_MAYMOVE);
+    if (memory != MAP_FAILED) {
+        vmm.memory = memory;
+        vmm.memory_size = memory_size;
+    }
+    if (!frames || !free_frames || !ghosts || memory == MAP_FAILED) {
+        // Shrinking cannot fail, so the tables still hold old_frames entries
+        pthread_mutex_unlock(&vmm.lock);
+        return -1;
+    }
+
+    vmm.num_frames = num_frames;
+    if (num_frames > old_frames) {
+        for (int w = BITMAP_WORDS(old_frames); w < BITMAP_WORDS(num_frames); w++) vmm.free_frames[w] = 0;
+        for (int f = old_frames; f < num_frames; f++) {
+            init_frame(f);
+            bitmap_set(vmm.free_frames, f);
+        }
+    } else if (num_frames & 63) {
+        // The bitmap helpers expect the bits past the last frame to be clear
+        vmm.free_frames[num_frames >> 6] &= (1ULL << (num_frames & 63)) - 1;
+    }
+    vmm.clock_hand = 0;
+    int rc = rebuild_replacement_locked();
+    pthread_mutex_unlock(&vmm.lock);
+
+    printf("VMM resized: %d -> %d frames (%ld KB)\n", old_frames, num_frames,
+           (long)num_frames * vmm.page_size / 1024);
+    return rc;
+}
+
+// Switch between one global frame pool and PFF-managed per-process quotas
+void set_frame_allocation(int pff) {
+    pthread_mutex_lock(&vmm.lock);
+    vmm.pff = pff;
+    vmm.total_quota = 0;
+    for (int i = 0; i < vmm.max_processes; i++) {
+        process_info_t *proc = &vmm.processes[i];
+        if (proc->pid == -1) continue;
+        // Start from what each process holds now
+        proc->quota = proc->resident > PFF_MIN_QUOTA ? proc->resident : PFF_MIN_QUOTA;
+        if (proc->quota > proc->num_pages) proc->quota = proc->num_pages;
+        proc->window_accesses = 0;
+        proc->window_faults = 0;
+        proc->thrashing = 0;
+        vmm.total_quota += proc->quota;
+    }
+    pthread_mutex_unlock(&vmm.lock);
+    printf("VMM frame allocation: %s\n", pff ? "pff (per-process quotas)" : "global");
+}
+
+// Swap a thrashing process out entirely; its frames and quota go back to
+// the pool so the remaining processes can fit
+void vmm_suspend(int proc_index) {
+    pthread_mutex_lock(&vmm.lock);
+    process_info_t *proc = &vmm.processes[proc_index];
+    while (proc->resident_head >= 0) evict_frame(proc->resident_head);
+    int quota = proc->num_pages < PFF_MIN_QUOTA ? proc->num_pages : PFF_MIN_QUOTA;
+    vmm.total_quota -= proc->quota - quota;
+    proc->quota = quota;
+    proc->window_accesses = 0;
+    proc->window_faults = 0;
+    proc->thrashing = 0;
+    vmm.thrash_suspends++;
+    pthread_mutex_unlock(&vmm.lock);
+}
+
+// Convert a text trace ("pid address r|w" per line, address in hex or
+// decimal) or valgrind lackey output (--tool=lackey --trace-mem=yes) to the
+// binary format. Lackey has no pid column; its "==pid==" banner supplies it.
+long trace_convert(const char* in_path, const char* out_path) {
+    FILE* in = fopen(in_path, "r");
+    if (!in) {
+        perror(in_path);
+        return -1;
+    }
+    FILE* out = fopen(out_path, "wb");
+    if (!out) {
+        perror(out_path);
+        fclose(in);
+        return -1;
+    }
+
+    trace_header_t header = { TRACE_MAGIC, TRACE_VERSION, 0 };
+    fwrite(&header, sizeof(header), 1, out);
+
+    char* line = NULL;
+    size_t cap = 0;
+    uint32_t lackey_pid = 1;
+    long skipped = 0;
+    while (getline(&line, &cap, in) > 0) {
+        trace_record_t rec = { 0, 0, 0 };
+        unsigned long long addr;
+        unsigned int pid, size;
+        char kind;
+
+        if (sscanf(line, "==%u==", &pid) == 1) {
+            lackey_pid = pid;
+            continue;
+        }
+        if (sscanf(line, " %c %llx,%u", &kind, &addr, &size) == 3 && strchr("ILSM", kind)) {
+            // Instruction fetches and loads read; stores and modifies write
+            rec.pid = lackey_pid;
+            rec.flags = (kind == 'S' || kind == 'M') ? TRACE_WRITE : 0;
+        } else if (sscanf(line, "%u %lli %c", &pid, (long long*)&addr, &kind) == 3 &&
+                   strchr("rRwW", kind)) {
+            rec.pid = pid;
+            rec.flags = (kind == 'w' || kind == 'W') ? TRACE_WRITE : 0;
+        } else {
+            skipped++;
+            continue;
+        }
+        rec.vaddr = addr;
+        fwrite(&rec, sizeof(rec), 1, out);
+        header.count++;
+    }
+    free(line);
+    fclose(in);
+
+    rewind(out);
+    fwrite(&header, sizeof(header), 1, out);
+    if (fclose(out) != 0) {
+        perror(out_path);
+        return -1;
+    }
+    printf("Converted %llu accesses to %s (%ld lines skipped)\n",
+           (unsigned long long)header.count, out_path, skipped);
+    return (long)header.count;
+}
+
+// Stream a binary trace through the TLB and page tables at full speed.
+// Each trace pid gets its own VMM process spanning the whole virtual
+// address space; they are released when the replay ends.
+int vmm_replay(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(trace_header_t)) {
+        printf("vmm replay: %s is not a trace\n", path);
+        close(fd);
+        return -1;
+    }
+    const char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+    const trace_header_t* header = (const trace_header_t*)map;
+    if (memcmp(header->magic, TRACE_MAGIC, 4) != 0 || header->version != TRACE_VERSION) {
+        printf("vmm replay: %s is not a version %d trace (see vmm convert)\n", path, TRACE_VERSION);
+        munmap((void*)map, st.st_size);
+        return -1;
+    }
+    uint64_t count = (st.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t);
+    if (header->count < count) count = header->count;
+    const trace_record_t* records = (const trace_record_t*)(header + 1);
+
+    uint32_t* pids = malloc(vmm.max_processes * sizeof(uint32_t));
+    int* slots = malloc(vmm.max_processes * sizeof(int));
+    if (!pids || !slots) {
+        free(pids);
+        free(slots);
+        munmap((void*)map, st.st_size);
+        perror("vmm replay");
+        return -1;
+    }
+    int num_pids = 0, last = -1;
+    int page_shift = __builtin_ctz(vmm.page_size);
+    long skipped = 0;
+
+    pthread_mutex_lock(&vmm.lock);
+    long faults_before = vmm.total_faults;
+    long tlb_hits_before = vmm.tlb_hits;
+    long evictions_before = vmm.evictions;
+    pthread_mutex_unlock(&vmm.lock);
+    long start = get_time();
+
+    for (uint64_t i = 0; i < count; ) {
+        pthread_mutex_lock(&vmm.lock);
+        uint64_t end = i + REPLAY_BATCH < count ? i + REPLAY_BATCH : count;
+        for (; i < end; i++) {
+            const trace_record_t* rec = &records[i];
+            // Records of one pid come in runs, so check the last one first
+            if (last < 0 || pids[last] != rec->pid) {
+                last = -1;
+                for (int p = 0; p < num_pids; p++) {
+                    if (pids[p] == rec->pid) last = p;
+                }
+                if (last < 0) break;  // New pid: allocate outside the lock
+            }
+            uint64_t page = rec->vaddr >> page_shift;
+            if (slots[last] < 0 || page >= (uint64_t)vmm.virtual_pages) {
+                skipped++;
+                continue;
+            }
+            vmm_access_locked(slots[last], (int)page, rec->flags & TRACE_WRITE);
+        }
+        pthread_mutex_unlock(&vmm.lock);
+
+        if (i < end && num_pids < vmm.max_processes) {
+            pids[num_pids] = records[i].pid;
+            slots[num_pids] = allocate_process_memory((int)records[i].pid,
+                                                      (long)vmm.virtual_pages * vmm.page_size);
+            if (slots[num_pids] < 0) printf("vmm replay: no VMM slot for trace pid %u\n", records[i].pid);
+            last = num_pids++;
+        } else if (i < end) {
+            skipped++;  // More trace pids than process slots
+            i++;
+        }
+    }
+    long elapsed = get_time() - start;
+
+    pthread_mutex_lock(&vmm.lock);
+    long faults = vmm.total_faults - faults_before;
+    long tlb_hits = vmm.tlb_hits - tlb_hits_before;
+    long evictions = vmm.evictions - evictions_before;
+    printf("Replayed %llu accesses from %s in %ld.%03ld s (%.0f accesses/s)\n",
+           (unsigned long long)(count - skipped), path, elapsed / 1000000, (elapsed / 1000) % 1000,
+           elapsed ? (count - skipped) * 1e6 / elapsed : 0.0);
+    printf("  Faults: %ld, Evictions: %ld, TLB hits: %ld, Policy: %s, Frames: %d\n",
+           faults, evictions, tlb_hits, repl_policy->name, vmm.num_frames);
+    if (skipped) printf("  Skipped: %ld (outside %d virtual pages; raise -v)\n", skipped, vmm.virtual_pages);
+    printf("  %-10s %-12s %-10s %-8s\n", "Trace PID", "Accesses", "Faults", "Fault%");
+    for (int p = 0; p < num_pids; p++) {
+        if (slots[p] < 0) continue;
+        process_info_t* proc = &vmm.processes[slots[p]];
+        printf("  %-10u %-12ld %-10ld %-8.2f\n", pids[p], proc->accesses, proc->faults,
+               proc->accesses ? proc->faults * 100.0 / proc->accesses : 0.0);
+    }
+    pthread_mutex_unlock(&vmm.lock);
+
+    for (int p = 0; p < num_pids; p++) {
+        if (slots[p] >= 0) deallocate_process_memory(slots[p]);
+    }
+    free(pids);
+    free(slots);
+    munmap((void*)map, st.st_size);
+    return 0;
+}
+
+// Scheduler Implementation
+
+// Wake a CPU's scheduler thread so it re-evaluates its queues immediately
+void scheduler_wake(CPU* cpu) {
+    pthread_mutex_lock(&cpu->event_lock);
+    cpu->events_pending = 1;
+    pthread_cond_signal(&cpu->event_cond);
+    pthread_mutex_unlock(&cpu->event_lock);
+}
+
+// Sleep until the given deadline (get_time() units, 0 = none) or an event
+void scheduler_wait(CPU* cpu, long deadline) {
+    pthread_mutex_lock(&cpu->event_lock);
+    if (deadline == 0) {
+        while (!cpu->events_pending && sched.scheduler_on) {
+            pthread_cond_wait(&cpu->event_cond, &cpu->event_lock);
+        }
+    } else {
+        long delay = deadline - get_time();
+        if (delay > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += delay / 1000000;
+            ts.tv_nsec += (delay % 1000000) * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            while (!cpu->events_pending && sched.scheduler_on) {
+                if (pthread_cond_timedwait(&cpu->event_cond, &cpu->event_lock, &ts) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+    }
+    cpu->events_pending = 0;
+    pthread_mutex_unlock(&cpu->event_lock);
+}
+
+// Nudge one idle CPU (other than self) so it can steal queued work
+void wake_idle_cpu(CPU* self) {
+    for (int i = 1; i < sched.num_cpus; i++) {
+        CPU* cpu = &sched.cpus[(self->id + i) % sched.num_cpus];
+        if (cpu->idle) {
+            scheduler_wake(cpu);
+            return;
+        }
+    }
+}
+
+// Make the real child match its simulated state; caller holds the CPU lock.
+// A failed setpriority (raising priority needs CAP_SYS_NICE or RLIMIT_NICE)
+// leaves nice_value alone so the next transition retries.
+void apply_enforcement(PCB* p) {
+    if (enforce_mode == ENFORCE_STOP) {
+        int stop = p->state != PROC_RUNNING;
+        if (stop != p->sig_stopped) {
+            kill(p->pid, stop ? SIGSTOP : SIGCONT);
+            p->sig_stopped = stop;
+        }
+    } else if (enforce_mode == ENFORCE_NICE) {
+        int nice_value = priority_nice[p->priority];
+        if (nice_value != p->nice_value) {
+            if (setpriority(PRIO_PROCESS, p->pid, nice_value) == 0) {
+                p->nice_value = nice_value;
+            } else if (scheduler_verbose) {
+                printf("Scheduler: PID %d nice %d -> %d failed: %s\n",
+                       p->pid, p->nice_value, nice_value, strerror(errno));
+            }
+        }
+    }
+}
+
+// Undo whatever enforcement did to p: resume it and restore nice 0
+void release_enforcement(PCB* p) {
+    if (p->sig_stopped) {
+        kill(p->pid, SIGCONT);
+        p->sig_stopped = 0;
+    }
+    if (p->nice_value != 0 && setpriority(PRIO_PROCESS, p->pid, 0) == 0) {
+        p->nice_value = 0;
+    }
+}
+
+void stop_scheduler() {
+    if (!sched.scheduler_on) return;
+    sched.scheduler_on = 0;
+    for (int i = 0; i < sched.num_cpus; i++) {
+        scheduler_wake(&sched.cpus[i]);
+    }
+    for (int i = 0; i < sched.num_cpus; i++) {
+        pthread_join(sched.cpus[i].thread, NULL);
+    }
+
+    // Never leave children frozen behind us
+    for (int i = 0; i < sched.pids.capacity; i++) {
+        if (sched.pids.slots[i]) release_enforcement(sched.pids.slots[i]);
+    }
+}
+
+// Lock the CPU that currently owns p. p->cpu only changes while both the old
+// and new CPU are locked, so re-checking after the lock is enough.
+CPU* lock_pcb_cpu(PCB* p) {
+    while (1) {
+        CPU* cpu = &sched.cpus[p->cpu];
+        pthread_mutex_lock(&cpu->lock);
+        if (cpu->id == p->cpu) return cpu;
+        pthread_mutex_unlock(&cpu->lock);
+    }
+}
+
+void wait_heap_swap(WaitHeap* h, int a, int b) {
+    PCB* tmp = h->items[a];
+    h->items[a] = h->items[b];
+    h->items[b] = tmp;
+    h->items[a]->heap_index = a;
+    h->items[b]->heap_index = b;
+}
+
+void wait_heap_sift_up(WaitHeap* h, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (h->items[parent]->io_deadline <= h->items[i]->io_deadline) break;
+        wait_heap_swap(h, i, parent);
+        i = parent;
+    }
+}
+
+void wait_heap_sift_down(WaitHeap* h, int i) {
+    while (1) {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int smallest = i;
+        if (left < h->count && h->items[left]->io_deadline < h->items[smallest]->io_deadline)
+            smallest = left;
+        if (right < h->count && h->items[right]->io_deadline < h->items[smallest]->io_deadline)
+            smallest = right;
+        if (smallest == i) break;
+        wait_heap_swap(h, i, smallest);
+        i = smallest;
+    }
+}
+
+// Remove the PCB at heap slot i; caller holds the CPU lock
+PCB* wait_heap_remove_locked(WaitHeap* h, int i) {
+    PCB* p = h->items[i];
+    h->count--;
+    if (i != h->count) {
+        h->items[i] = h->items[h->count];
+        h->items[i]->heap_index = i;
+        wait_heap_sift_down(h, i);
+        wait_heap_sift_up(h, i);
+    }
+    p->heap_index = -1;
+    return p;
+}
+
+// Insert p keyed by p->io_deadline; caller holds the CPU lock
+int wait_heap_push_locked(WaitHeap* h, PCB* p) {
+    if (h->count == h->capacity) {
+        int new_cap = h->capacity ? h->capacity * 2 : DEFAULT_PROCESSES;
+        PCB** grown = realloc(h->items, new_cap * sizeof(PCB*));
+        if (!grown) return -1;
+        h->items = grown;
+        h->capacity = new_cap;
+    }
+    p->heap_index = h->count;
+    h->items[h->count++] = p;
+    wait_heap_sift_up(h, p->heap_index);
+    return 0;
+}
+
+// Append p to the FIFO for its priority level; caller holds the CPU lock.
+// Stamping under the lock keeps every level ordered by ready_since.
+void ready_push_locked(ReadyQueue* rq, PCB* p) {
+    if (p->priority < 0) p->priority = 0;
+    if (p->priority >= PRIORITY_LEVELS) p->priority = PRIORITY_LEVELS - 1;
+
+    PriorityLevel* lvl = &rq->levels[p->priority];
+    p->ready_since = get_time();
+    p->next = NULL;
+    p->prev = lvl->tail;
+    if (!lvl->head) {
+        lvl->head = p;
+    } else {
+        lvl->tail->next = p;
+    }
+    lvl->tail = p;
+    rq->bitmap |= 1u << p->priority;
+    rq->count++;
+}
+
+// Unlink a READY p from its priority level in O(1); caller holds the CPU lock
+void ready_unlink_locked(ReadyQueue* rq, PCB* p) {
+    PriorityLevel* lvl = &rq->levels[p->priority];
+
+    if (p->prev) {
+        p->prev->next = p->next;
+    } else {
+        lvl->head = p->next;
+    }
+    if (p->next) {
+        p->next->prev = p->prev;
+    } else {
+        lvl->tail = p->prev;
+    }
+    if (!lvl->head) rq->bitmap &= ~(1u << p->priority);
+    rq->count--;
+    p->next = NULL;
+    p->prev = NULL;
+}
+
+// Pop the head of the highest non-empty level; caller holds the CPU lock
+PCB* dequeue_by_priority(ReadyQueue* rq) {
+    if (!rq->bitmap) return NULL;
+
+    // Lowest set bit = highest priority non-empty level
+    PCB* best = rq->levels[__builtin_ctz(rq->bitmap)].head;
+    ready_unlink_locked(rq, best);
+    return best;
+}
+
+// Promote PCBs that have sat in a level for AGING_PERIOD. Each level is
+// FIFO by ready_since, so only expired heads are touched. Returns the time
+// the next promotion is due, or 0 if nothing below level 0 is waiting.
+// Caller holds the CPU lock.
+long age_ready_queue(ReadyQueue* rq, long now) {
+    long next_due = 0;
+
+    // Walk levels top-down so a promoted PCB is not aged twice
+    for (int level = 1; level < PRIORITY_LEVELS; level++) {
+        PriorityLevel* lvl = &rq->levels[level];
+        while (lvl->head && now - lvl->head->ready_since >= AGING_PERIOD) {
+            PCB* p = lvl->head;
+            ready_unlink_locked(rq, p);
+            p->priority--;
+            ready_push_locked(rq, p);
+            apply_enforcement(p);
+            if (scheduler_verbose) {
+                printf("Scheduler: PID %d aged up to priority %d\n", 
+                       p->pid, p->priority);
+            }
+        }
+        if (lvl->head) {
+            long due = lvl->head->ready_since + AGING_PERIOD;
+            if (next_due == 0 || due < next_due) next_due = due;
+        }
+    }
+    return next_due;
+}
+
+// Red-black ready tree (cfs, sjf). NULL children are the black leaves.
+void rb_rotate_left(ReadyTree* t, PCB* x) {
+    PCB* y = x->rb_right;
+    x->rb_right = y->rb_left;
+    if (y->rb_left) y->rb_left->rb_parent = x;
+    y->rb_parent = x->rb_parent;
+    if (!x->rb_parent) {
+        t->root = y;
+    } else if (x == x->rb_parent->rb_left) {
+        x->rb_parent->rb_left = y;
+    } else {
+        x->rb_parent->rb_right = y;
+    }
+    y->rb_left = x;
+    x->rb_parent = y;
+}
+
+void rb_rotate_right(ReadyTree* t, PCB* x) {
+    PCB* y = x->rb_left;
+    x->rb_left = y->rb_right;
+    if (y->rb_right) y->rb_right->rb_parent = x;
+    y->rb_parent = x->rb_parent;
+    if (!x->rb_parent) {
+        t->root = y;
+    } else if (x == x->rb_parent->rb_right) {
+        x->rb_parent->rb_right = y;
+    } else {
+        x->rb_parent->rb_left = y;
+    }
+    y->rb_right = x;
+    x->rb_parent = y;
+}
+
+// Put v where u hangs from its parent
+void rb_transplant(ReadyTree* t, PCB* u, PCB* v) {
+    if (!u->rb_parent) {
+        t->root = v;
+    } else if (u == u->rb_parent->rb_left) {
+        u->rb_parent->rb_left = v;
+    } else {
+        u->rb_parent->rb_right = v;
+    }
+    if (v) v->rb_parent = u->rb_parent;
+}
+
+PCB* rb_next(PCB* p) {
+    if (p->rb_right) {
+        p = p->rb_right;
+        while (p->rb_left) p = p->rb_left;
+        return p;
+    }
+    while (p->rb_parent && p == p->rb_parent->rb_right) p = p->rb_parent;
+    return p->rb_parent;
+}
+
+// Insert p by sched_key; equal keys go right so ties stay FIFO
+void ready_tree_insert(ReadyTree* t, PCB* p) {
+    PCB* parent = NULL;
+    PCB** link = &t->root;
+    int leftmost = 1;
+    while (*link) {
+        parent = *link;
+        if (p->sched_key < parent->sched_key) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+    p->rb_parent = parent;
+    p->rb_left = NULL;
+    p->rb_right = NULL;
+    p->rb_red = 1;
+    *link = p;
+    if (leftmost) t->leftmost = p;
+    p->ready_since = get_time();
+
+    PCB* x = p;
+    while (x != t->root && x->rb_parent->rb_red) {
+        PCB* par = x->rb_parent;
+        PCB* grand = par->rb_parent;  // Exists: a red node is never the root
+        if (par == grand->rb_left) {
+            PCB* uncle = grand->rb_right;
+            if (uncle && uncle->rb_red) {
+                par->rb_red = 0;
+                uncle->rb_red = 0;
+                grand->rb_red = 1;
+                x = grand;
+            } else {
+                if (x == par->rb_right) {
+                    x = par;
+                    rb_rotate_left(t, x);
+                    par = x->rb_parent;
+                }
+                par->rb_red = 0;
+                grand->rb_red = 1;
+                rb_rotate_right(t, grand);
+            }
+        } else {
+            PCB* uncle = grand->rb_left;
+            if (uncle && uncle->rb_red) {
+                par->rb_red = 0;
+                uncle->rb_red = 0;
+                grand->rb_red = 1;
+                x = grand;
+            } else {
+                if (x == par->rb_left) {
+                    x = par;
+                    rb_rotate_right(t, x);
+                    par = x->rb_parent;
+                }
+                par->rb_red = 0;
+                grand->rb_red = 1;
+                rb_rotate_left(t, grand);
+            }
+        }
+    }
+    t->root->rb_red = 0;
+}
+
+// Restore the black height after removing a black node; x (maybe NULL)
+// now sits under parent where that node was
+void rb_erase_fixup(ReadyTree* t, PCB* x, PCB* parent) {
+    while (x != t->root && (!x || !x->rb_red)) {
+        if (x == parent->rb_left) {
+            PCB* w = parent->rb_right;
+            if (w->rb_red) {
+                w->rb_red = 0;
+                parent->rb_red = 1;
+                rb_rotate_left(t, parent);
+                w = parent->rb_right;
+            }
+            if ((!w->rb_left || !w->rb_left->rb_red) && (!w->rb_right || !w->rb_right->rb_red)) {
+                w->rb_red = 1;
+                x = parent;
+                parent = x->rb_parent;
+            } else {
+                if (!w->rb_right || !w->rb_right->rb_red) {
+                    w->rb_left->rb_red = 0;
+                    w->rb_red = 1;
+                    rb_rotate_right(t, w);
+                    w = parent->rb_right;
+                }
+                w->rb_red = parent->rb_red;
+                parent->rb_red = 0;
+                if (w->rb_right) w->rb_right->rb_red = 0;
+                rb_rotate_left(t, parent);
+                x = t->root;
+            }
+        } else {
+            PCB* w = parent->rb_left;
+            if (w->rb_red) {
+                w->rb_red = 0;
+                parent->rb_red = 1;
+                rb_rotate_right(t, parent);
+                w = parent->rb_left;
+            }
+            if ((!w->rb_left || !w->rb_left->rb_red) && (!w->rb_right || !w->rb_right->rb_red)) {
+                w->rb_red = 1;
+                x = parent;
+                parent = x->rb_parent;
+            } else {
+                if (!w->rb_left || !w->rb_left->rb_red) {
+                    w->rb_right->rb_red = 0;
+                    w->rb_red = 1;
+                    rb_rotate_left(t, w);
+                    w = parent->rb_left;
+                }
+                w->rb_red = parent->rb_red;
+                parent->rb_red = 0;
+                if (w->rb_left) w->rb_left->rb_red = 0;
+                rb_rotate_right(t, parent);
+                x = t->root;
+            }
+        }
+    }
+    if (x) x->rb_red = 0;
+}
+
+void ready_tree_erase(ReadyTree* t, PCB* z) {
+    if (t->leftmost == z) t->leftmost = rb_next(z);
+
+    PCB* x;
+    PCB* x_parent;
+    int removed_red;
+    if (!z->rb_left || !z->rb_right) {
+        x = z->rb_left ? z->rb_left : z->rb_right;
+        x_parent = z->rb_parent;
+        removed_red = z->rb_red;
+        rb_transplant(t, z, x);
+    } else {
+        // Splice z's successor into z's place
+        PCB* y = z->rb_right;
+        while (y->rb_left) y = y->rb_left;
+        removed_red = y->rb_red;
+        x = y->rb_right;
+        if (y->rb_parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->rb_parent;
+            rb_transplant(t, y, x);
+            y->rb_right = z->rb_right;
+            y->rb_right->rb_parent = y;
+        }
+        rb_transplant(t, z, y);
+        y->rb_left = z->rb_left;
+        y->rb_left->rb_parent = y;
+        y->rb_red = z->rb_red;
+    }
+    if (!removed_red) rb_erase_fixup(t, x, x_parent);
+    z->rb_parent = NULL;
+    z->rb_left = NULL;
+    z->rb_right = NULL;
+}
+
+// Policy: rr - round robin over priority levels, demote on preemption,
+// boost on I/O completion, age waiting PCBs upward
+void rr_enqueue(CPU* cpu, PCB* p, EnqueueReason why) {
+    if (why == ENQ_WAKEUP) {
+        p->priority = 0;  // I/O means higher priority
+    } else if (why == ENQ_PREEMPT && p->priority < PRIORITY_LEVELS - 1) {
+        p->priority++;
+    }
+    ready_push_locked(&cpu->ready, p);
+}
+
+void levels_dequeue(CPU* cpu, PCB* p) {
+    ready_unlink_locked(&cpu->ready, p);
+}
+
+PCB* levels_pick_next(CPU* cpu) {
+    return dequeue_by_priority(&cpu->ready);
+}
+
+long rr_tick(CPU* cpu, long now) {
+    return age_ready_queue(&cpu->ready, now);
+}
+
+void levels_exit(CPU* cpu, PCB* p) {
+    if (p->state == PROC_READY) ready_unlink_locked(&cpu->ready, p);
+}
+
+long rr_time_slice(CPU* cpu, PCB* p) {
+    (void)cpu;
+    (void)p;
+    return TIME_SLICE;
+}
+
+int levels_collect(CPU* cpu, PCB** out, int max) {
+    int n = 0;
+    for (int level = 0; level < PRIORITY_LEVELS; level++) {
+        for (PCB* p = cpu->ready.levels[level].head; p && n < max; p = p->next) {
+            out[n++] = p;
+        }
+    }
+    return n;
+}
+
+// Policy: mlfq - arrivals start at the top, a full quantum demotes, I/O keeps
+// the level, quanta double per level and everything is boosted periodically
+void mlfq_enqueue(CPU* cpu, PCB* p, EnqueueReason why) {
+    if (why == ENQ_NEW) {
+        p->priority = 0;
+    } else if (why == ENQ_PREEMPT && p->priority < PRIORITY_LEVELS - 1) {
+        p->priority++;
+    }
+    ready_push_locked(&cpu->ready, p);
+}
+
+long mlfq_tick(CPU* cpu, long now) {
+    if (cpu->nr_ready == 0 && !cpu->running && cpu->waiting.count == 0) return 0;
+    if (cpu->next_boost == 0) cpu->next_boost = now + MLFQ_BOOST_PERIOD;
+    if (now < cpu->next_boost) return cpu->next_boost;
+
+    for (int level = 1; level < PRIORITY_LEVELS; level++) {
+        while (cpu->ready.levels[level].head) {
+            PCB* p = cpu->ready.levels[level].head;
+            ready_unlink_locked(&cpu->ready, p);
+            p->priority = 0;
+            ready_push_locked(&cpu->ready, p);
+            apply_enforcement(p);
+        }
+    }
+    for (int i = 0; i < cpu->waiting.count; i++) {
+        cpu->waiting.items[i]->priority = 0;
+    }
+    if (cpu->running) {
+        cpu->running->priority = 0;
+        apply_enforcement(cpu->running);
+    }
+    if (scheduler_verbose) {
+        printf("Scheduler: CPU %d MLFQ priority boost\n", cpu->id);
+    }
+    cpu->next_boost = now + MLFQ_BOOST_PERIOD;
+    return cpu->next_boost;
+}
+
+long mlfq_time_slice(CPU* cpu, PCB* p) {
+    (void)cpu;
+    return (TIME_SLICE / 2) << p->priority;  // 50, 100, 200ms
+}
+
+// Tree policy helpers shared by cfs and sjf
+void tree_dequeue(CPU* cpu, PCB* p) {
+    ready_tree_erase(&cpu->tree, p);
+    cpu->tree.load -= priority_weight[p->priority];
+}
+
+PCB* tree_pick_next(CPU* cpu) {
+    PCB* p = cpu->tree.leftmost;
+    if (p) tree_dequeue(cpu, p);
+    return p;
+}
+
+void tree_exit(CPU* cpu, PCB* p) {
+    if (p->state == PROC_READY) tree_dequeue(cpu, p);
+}
+
+long tree_tick(CPU* cpu, long now) {
+    (void)cpu;
+    (void)now;
+    return 0;
+}
+
+int tree_collect(CPU* cpu, PCB** out, int max) {
+    int n = 0;
+    for (PCB* p = cpu->tree.leftmost; p && n < max; p = rb_next(p)) {
+        out[n++] = p;
+    }
+    return n;
+}
+
+// Policy: cfs - run the PCB with the least weighted CPU time; priority
+// levels map to the nice 0/10/19 load weights
+void cfs_charge(PCB* p) {
+    p->vruntime += p->last_burst * CFS_NICE0_WEIGHT / priority_weight[p->priority];
+}
+
+void cfs_enqueue(CPU* cpu, PCB* p, EnqueueReason why) {
+    long floor = cpu->tree.min_vruntime;
+    if (why == ENQ_PREEMPT) {
+        cfs_charge(p);
+    } else if (why == ENQ_WAKEUP) {
+        floor -= CFS_LATENCY / 2;  // Small credit for sleepers
+    }
+    if (why != ENQ_MOVE && p->vruntime < floor) p->vruntime = floor;
+
+    p->sched_key = p->vruntime;
+    ready_tree_insert(&cpu->tree, p);
+    cpu->tree.load += priority_weight[p->priority];
+}
+
+PCB* cfs_pick_next(CPU* cpu) {
+    PCB* p = tree_pick_next(cpu);
+    if (p && p->vruntime > cpu->tree.min_vruntime) cpu->tree.min_vruntime = p->vruntime;
+    return p;
+}
+
+void cfs_block(CPU* cpu, PCB* p) {
+    (void)cpu;
+    cfs_charge(p);
+}
+
+// Keep the stolen PCB's lag relative to the new CPU's floor
+void cfs_migrate(CPU* from, CPU* to, PCB* p) {
+    p->vruntime += to->tree.min_vruntime - from->tree.min_vruntime;
+}
+
+// Share CFS_LATENCY among the runnable PCBs by weight
+long cfs_time_slice(CPU* cpu, PCB* p) {
+    long weight = priority_weight[p->priority];
+    long slice = CFS_LATENCY * weight / (cpu->tree.load + weight);
+    return slice < CFS_MIN_GRANULARITY ? CFS_MIN_GRANULARITY : slice;
+}
+
+// Policy: sjf - shortest predicted burst first, predicted by exponential
+// averaging (alpha 1/2) of observed bursts, preempted at TIME_SLICE
+void sjf_update(PCB* p) {
+    p->burst_estimate = (p->last_burst + p->burst_estimate) / 2;
+}
+
+void sjf_enqueue(CPU* cpu, PCB* p, EnqueueReason why) {
+    if (why == ENQ_PREEMPT) sjf_update(p);
+    p->sched_key = p->burst_estimate;
+    ready_tree_insert(&cpu->tree, p);
+    cpu->tree.load += priority_weight[p->priority];
+}
+
+void sjf_block(CPU* cpu, PCB* p) {
+    (void)cpu;
+    sjf_update(p);
+}
+
+const SchedPolicy sched_policies[] = {
+    {"rr", "Round Robin + Priority + Aging",
+     rr_enqueue, levels_dequeue, levels_pick_next, rr_tick, NULL, levels_exit,
+     NULL, rr_time_slice, levels_collect},
+    {"mlfq", "Multi-Level Feedback Queue",
+     mlfq_enqueue, levels_dequeue, levels_pick_next, mlfq_tick, NULL, levels_exit,
+     NULL, mlfq_time_slice, levels_collect},
+    {"cfs", "Completely Fair (vruntime red-black tree)",
+     cfs_enqueue, tree_dequeue, cfs_pick_next, tree_tick, cfs_block, tree_exit,
+     cfs_migrate, cfs_time_slice, tree_collect},
+    {"sjf", "Shortest Job First (predicted burst)",
+     sjf_enqueue, tree_dequeue, tree_pick_next, tree_tick, sjf_block, tree_exit,
+     NULL, rr_time_slice, tree_collect},
+};
+#define NUM_POLICIES (int)(sizeof(sched_policies) / sizeof(sched_policies[0]))
+
+const SchedPolicy* sched_policy = &sched_policies[0];
+
+// Core entry points into the policy; caller holds the CPU lock and has set
+// p->state to PROC_READY
+void sched_enqueue_locked(CPU* cpu, PCB* p, EnqueueReason why) {
+    sched_policy->on_enqueue(cpu, p, why);
+    cpu->nr_ready++;
+    apply_enforcement(p);
+}
+
+void sched_dequeue_locked(CPU* cpu, PCB* p) {
+    sched_policy->dequeue(cpu, p);
+    cpu->nr_ready--;
+}
+
+PCB* sched_pick_next_locked(CPU* cpu) {
+    PCB* p = sched_policy->pick_next(cpu);
+    if (p) cpu->nr_ready--;
+    return p;
+}
+
+// Place a new arrival on the least-loaded CPU and wake it
+void enqueue_ready(PCB* p) {
+    CPU* best = &sched.cpus[0];
+    int best_load = INT_MAX;
+    for (int i = 0; i < sched.num_cpus; i++) {
+        CPU* cpu = &sched.cpus[i];
+        int load = cpu->nr_ready + (cpu->running ? 1 : 0);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+
+    pthread_mutex_lock(&best->lock);
+    p->cpu = best->id;
+    sched_enqueue_locked(best, p, ENQ_NEW);
+
+    if (scheduler_verbose) {
+        printf("Scheduler: Enqueued PID %d on CPU %d (priority %d)\n",
+               p->pid, best->id, p->priority);
+    }
+    pthread_mutex_unlock(&best->lock);
+    scheduler_wake(best);
+}
+
+int init_pcb_pool(int max_processes) {
+    pcb_pool.slots = calloc(max_processes, sizeof(PCB));
+    if (!pcb_pool.slots) return -1;
+    pcb_pool.capacity = max_processes;
+    pcb_pool.free_list = NULL;
+    pcb_pool.in_use = 0;
+    for (int i = max_processes - 1; i >= 0; i--) {
+        pcb_pool.slots[i].next = pcb_pool.free_list;
+        pcb_pool.free_list = &pcb_pool.slots[i];
+    }
+    return 0;
+}
+
+PCB* pcb_alloc() {
+    PCB* p = pcb_pool.free_list;
+    if (!p) return NULL;
+    pcb_pool.free_list = p->next;
+    pcb_pool.in_use++;
+    return p;
+}
+
+void pcb_free(PCB* p) {
+    p->next = pcb_pool.free_list;
+    pcb_pool.free_list = p;
+    pcb_pool.in_use--;
+}
+
+unsigned int pid_hash(int pid, int capacity) {
+    return ((unsigned int)pid * 2654435761u) & (capacity - 1);
+}
+
+int pid_table_insert(PidTable* t, PCB* p) {
+    if ((t->count + 1) * 2 > t->capacity) {
+        // Keep load factor <= 1/2 so probe chains stay short
+        int new_cap = t->capacity ? t->capacity * 2 : 2 * DEFAULT_PROCESSES;
+        PCB** slots = calloc(new_cap, sizeof(PCB*));
+        if (!slots) return -1;
+        for (int i = 0; i < t->capacity; i++) {
+            if (!t->slots[i]) continue;
+            unsigned int j = pid_hash(t->slots[i]->pid, new_cap);
+            while (slots[j]) j = (j + 1) & (new_cap - 1);
+            slots[j] = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->capacity = new_cap;
+    }
+
+    unsigned int i = pid_hash(p->pid, t->capacity);
+    while (t->slots[i]) i = (i + 1) & (t->capacity - 1);
+    t->slots[i] = p;
+    t->count++;
+    return 0;
+}
+
+PCB* pid_table_lookup(PidTable* t, int pid) {
+    if (t->count == 0) return NULL;
+    unsigned int i = pid_hash(pid, t->capacity);
+    while (t->slots[i]) {
+        if (t->slots[i]->pid == pid) return t->slots[i];
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return NULL;
+}
+
+void pid_table_remove(PidTable* t, int pid) {
+    if (t->count == 0) return;
+    unsigned int mask = t->capacity - 1;
+    unsigned int i = pid_hash(pid, t->capacity);
+    while (t->slots[i] && t->slots[i]->pid != pid) i = (i + 1) & mask;
+    if (!t->slots[i]) return;
+
+    // Backward-shift deletion: pull later entries of the chain into the hole
+    t->slots[i] = NULL;
+    t->count--;
+    unsigned int j = (i + 1) & mask;
+    while (t->slots[j]) {
+        unsigned int home = pid_hash(t->slots[j]->pid, t->capacity);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            t->slots[i] = t->slots[j];
+            t->slots[j] = NULL;
+            i = j;
+        }
+        j = (j + 1) & mask;
+    }
+}
+
+PCB* create_process(int pid, const char* cmd, int memory_size) {
+    PCB* p = pcb_alloc();
+    if (!p) return NULL;
+
+    p->pid = pid;
+    strncpy(p->command, cmd, 63);
+    p->command[63] = '\0';
+    p->state = PROC_NEW;
+    p->priority = 1;        // Start normal priority
+    p->cpu_time = 0;
+    p->wait_time = 0;
+    p->arrival_time = get_time();
+    p->last_run = 0;
+    p->ready_since = 0;
+    p->io_deadline = 0;
+    p->heap_index = -1;
+    p->cpu = 0;
+    p->io_count = 0;
+    p->memory_allocated = memory_size;
+    p->real_cpu_us = 0;
+    p->max_rss_kb = 0;
+    p->ctx_switches = 0;
+    p->last_burst = 0;
+    p->vruntime = 0;
+    p->burst_estimate = TIME_SLICE;
+    p->sched_key = 0;
+    p->access_clock = 0;
+    p->rb_parent = NULL;
+    p->rb_left = NULL;
+    p->rb_right = NULL;
+    p->rb_red = 0;
+    p->sig_stopped = 0;
+    p->nice_value = 0;
+    p->next = NULL;
+    p->prev = NULL;
+
+    // Allocate memory through VMM
+    p->vmm_slot = allocate_process_memory(pid, memory_size);
+    if (p->vmm_slot < 0) {
+        pcb_free(p);
+        return NULL;
+    }
+
+    if (pid_table_insert(&sched.pids, p) != 0) {
+        deallocate_process_memory(p->vmm_slot);
+        pcb_free(p);
+        return NULL;
+    }
+
+    sched.total_procs++;
+
+    if (scheduler_verbose) {
+        printf("Scheduler: Created PID %d (%s) with %d KB\n", 
+               pid, cmd, memory_size/1024);
+    }
+
+    return p;
+}
+
+// Called by an idle CPU without its own lock held: take the highest
+// priority ready PCB from a busy CPU and run it here. Returns 1 on success.
+int steal_work(CPU* self, long now) {
+    for (int i = 1; i < sched.num_cpus; i++) {
+        CPU* victim = &sched.cpus[(self->id + i) % sched.num_cpus];
+        if (victim->nr_ready == 0) continue;
+
+        CPU* first = victim->id < self->id ? victim : self;
+        CPU* second = victim->id < self->id ? self : victim;
+        pthread_mutex_lock(&first->lock);
+        pthread_mutex_lock(&second->lock);
+
+        int stolen = 0;
+        if (!self->running && self->nr_ready == 0 && victim->nr_ready > 0) {
+            PCB* p = sched_pick_next_locked(victim);
+            if (sched_policy->on_migrate) sched_policy->on_migrate(victim, self, p);
+            p->cpu = self->id;
+            p->state = PROC_RUNNING;
+            p->last_run = now;
+            p->access_clock = now;
+            self->running = p;
+            self->dispatches++;
+            self->steals++;
+            self->idle = 0;
+            stolen = 1;
+            apply_enforcement(p);
+
+            if (scheduler_verbose) {
+                printf("Scheduler: CPU %d stole PID %d from CPU %d\n",
+                       self->id, p->pid, victim->id);
+            }
+        }
+
+        pthread_mutex_unlock(&second->lock);
+        pthread_mutex_unlock(&first->lock);
+        if (stolen) return 1;
+    }
+    return 0;
+}
+
+// Turn the time p has been RUNNING since access_clock into synthetic memory
+// references: mostly near the last page touched, sometimes anywhere, a
+// quarter of them writes. Caller holds the CPU lock, which keeps p alive.
+// Returns 1 if the PFF allocator found the process thrashing.
+int run_memory_accesses(CPU* cpu, PCB* p, long now) {
+    long n = (now - p->access_clock) / ACCESS_INTERVAL;
+    if (p->vmm_slot < 0 || n <= 0) return 0;
+    p->access_clock += n * ACCESS_INTERVAL;
+    if (n > MAX_ACCESS_BURST) n = MAX_ACCESS_BURST;
+
+    pthread_mutex_lock(&vmm.lock);
+    process_info_t *proc = &vmm.processes[p->vmm_slot];
+    int pages = proc->num_pages;
+    for (long i = 0; i < n; i++) {
+        int page;
+        if (rand_r(&cpu->seed) % 5 == 0) {
+            page = rand_r(&cpu->seed) % pages;
+        } else {
+            page = (proc->last_page + rand_r(&cpu->seed) % 3 - 1 + pages) % pages;
+        }
+        vmm_access_locked(p->vmm_slot, page, rand_r(&cpu->seed) % 4 == 0);
+    }
+    int thrashing = proc->thrashing;
+    pthread_mutex_unlock(&vmm.lock);
+    return thrashing;
+}
+
+// Take p off the CPU into the wait heap until the given time
+void park_locked(CPU* cpu, PCB* p, long now, long until) {
+    p->state = PROC_WAITING;
+    p->last_run = now;
+    p->io_deadline = until;
+    if (sched_policy->on_block) sched_policy->on_block(cpu, p);
+    wait_heap_push_locked(&cpu->waiting, p);
+    apply_enforcement(p);
+}
+
+void* scheduler_main(void* arg) {
+    CPU* cpu = arg;
+
+    while (sched.scheduler_on) {
+        long now = get_time();
+        long deadline = 0;
+
+        pthread_mutex_lock(&cpu->lock);
+
+        // Handle I/O completion: pop only expired deadlines straight into
+        // the ready queue under the same lock, so no PCB is ever in flight
+        while (cpu->waiting.count > 0 && cpu->waiting.items[0]->io_deadline <= now) {
+            PCB* ready_proc = wait_heap_remove_locked(&cpu->waiting, 0);
+            ready_proc->state = PROC_READY;
+            ready_proc->wait_time += now - ready_proc->last_run;
+            sched_enqueue_locked(cpu, ready_proc, ENQ_WAKEUP);
+
+            if (scheduler_verbose) {
+                printf("Scheduler: PID %d I/O completed, priority now %d\n",
+                       ready_proc->pid, ready_proc->priority);
+            }
+        }
+        if (cpu->waiting.count > 0) {
+            deadline = cpu->waiting.items[0]->io_deadline;
+        }
+
+        // The running process has been touching memory all along. If it is
+        // thrashing, swap it out for a while so the others can make progress.
+        if (cpu->running && run_memory_accesses(cpu, cpu->running, now)) {
+            PCB* thrashing = cpu->running;
+            cpu->running = NULL;
+            thrashing->last_burst = now - thrashing->last_run;
+            thrashing->cpu_time += thrashing->last_burst;
+            park_locked(cpu, thrashing, now, now + PFF_SUSPEND_TIME);
+            vmm_suspend(thrashing->vmm_slot);
+            if (deadline == 0 || thrashing->io_deadline < deadline) deadline = thrashing->io_deadline;
+
+            if (scheduler_verbose) {
+                printf("Scheduler: PID %d thrashing, swapped out for %d ms\n",
+                       thrashing->pid, PFF_SUSPEND_TIME / 1000);
+            }
+        }
+
+        // Check for preemption
+        if (cpu->running && (now - cpu->running->last_run >= sched_policy->time_slice(cpu, cpu->running))) {
+            PCB* preempted = cpu->running;
+            cpu->running = NULL;
+            preempted->state = PROC_READY;
+            preempted->last_burst = now - preempted->last_run;
+            preempted->cpu_time += preempted->last_burst;
+
+            // Simple I/O simulation
+            if (rand_r(&cpu->seed) % 4 == 0) {  // 25% chance
+                preempted->io_count++;
+                park_locked(cpu, preempted, now, now + IO_TIME);
+                if (deadline == 0 || preempted->io_deadline < deadline) deadline = preempted->io_deadline;
+
+                if (scheduler_verbose) {
+                    printf("Scheduler: PID %d moved to I/O wait\n", preempted->pid);
+                }
+            } else {
+                sched_enqueue_locked(cpu, preempted, ENQ_PREEMPT);
+
+                if (scheduler_verbose) {
+                    printf("Scheduler: PID %d preempted, priority now %d\n", 
+                           preempted->pid, preempted->priority);
+                }
+            }
+        }
+
+        // Policy housekeeping (aging, boosts) that is due by now
+        long next_tick = sched_policy->on_tick(cpu, now);
+        if (next_tick && (deadline == 0 || next_tick < deadline)) deadline = next_tick;
+        
+        // Select next process
+        if (!cpu->running) {
+            PCB* next = sched_pick_next_locked(cpu);
+            if (next) {
+                cpu->running = next;
+                cpu->dispatches++;
+                next->state = PROC_RUNNING;
+                next->last_run = now;
+                next->access_clock = now;
+                apply_enforcement(next);
+                
+                if (scheduler_verbose) {
+                    printf("Scheduler: CPU %d running PID %d (priority %d)\n", 
+                           cpu->id, next->pid, next->priority);
+                }
+            }
+        }
+
+        cpu->idle = !cpu->running && cpu->nr_ready == 0;
+        int surplus = cpu->nr_ready > 0;
+        pthread_mutex_unlock(&cpu->lock);
+
+        // An idle CPU pulls work from a busy one; a busy CPU with queued
+        // work lets an idle peer know there is something to steal
+        if (cpu->idle && sched.num_cpus > 1) {
+            steal_work(cpu, now);
+        } else if (surplus && sched.num_cpus > 1) {
+            wake_idle_cpu(cpu);
+        }
+
+        // Sleep until the next preemption, I/O completion or policy tick
+        pthread_mutex_lock(&cpu->lock);
+        if (cpu->running) {
+            long slice_end = cpu->running->last_run + sched_policy->time_slice(cpu, cpu->running);
+            if (deadline == 0 || slice_end < deadline) deadline = slice_end;
+        }
+        pthread_mutex_unlock(&cpu->lock);
+        scheduler_wait(cpu, deadline);
+    }
+    return NULL;
+}
+
+// Caller holds the owning CPU's lock and has removed p from its queue
+void finish_process(PCB* p) {
+    CPU* cpu = &sched.cpus[p->cpu];
+    if (cpu->running == p) {
+        cpu->running = NULL;
+        scheduler_wake(cpu);  // Let the next ready process run now
+    }
+    pid_table_remove(&sched.pids, p->pid);
+    
+    long now = get_time();
+    p->state = PROC_TERMINATED;
+    sched.done_procs++;
+    sched.total_turnaround += now - p->arrival_time;
+    sched.turnaround_samples[sched.num_samples++ % TURNAROUND_SAMPLES] = now - p->arrival_time;
+    sched.total_wait += p->wait_time;
+    sched.total_real_cpu += p->real_cpu_us;
+    sched.total_ctx_switches += p->ctx_switches;
+    if (p->max_rss_kb > sched.peak_rss_kb) sched.peak_rss_kb = p->max_rss_kb;
+    
+    deallocate_process_memory(p->vmm_slot);
+    
+    if (scheduler_verbose) {
+        printf("Scheduler: PID %d finished (CPU: %dms, Wait: %dms, I/O: %d)\n", 
+               p->pid, p->cpu_time/1000, p->wait_time/1000, p->io_count);
+        printf("Scheduler: PID %d real usage (CPU: %ldms, Wall: %ldms, MaxRSS: %ldKB, CSW: %ld)\n",
+               p->pid, p->real_cpu_us/1000, (now - p->arrival_time)/1000,
+               p->max_rss_kb, p->ctx_switches);
+    }
+    
+    pcb_free(p);
+}
+
+// Refresh a live child's real usage from /proc/<pid>/stat and /status
+void sample_proc_usage(PCB* p) {
+    char path[64];
+    char line[512];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", p->pid);
+    FILE* f = fopen(path, "r");
+    if (!f) return;
+    if (fgets(line, sizeof(line), f)) {
+        // Skip "pid (comm)"; comm may contain spaces, so find the last ')'
+        char* rest = strrchr(line, ')');
+        unsigned long utime, stime;
+        if (rest && sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                           &utime, &stime) == 2) {
+            p->real_cpu_us = (long)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+        }
+    }
+    fclose(f);
+
+    snprintf(path, sizeof(path), "/proc/%d/status", p->pid);
+    f = fopen(path, "r");
+    if (!f) return;
+    long voluntary = 0, involuntary = 0;
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "VmHWM: %ld", &p->max_rss_kb);
+        sscanf(line, "voluntary_ctxt_switches: %ld", &voluntary);
+        sscanf(line, "nonvoluntary_ctxt_switches: %ld", &involuntary);
+    }
+    p->ctx_switches = voluntary + involuntary;
+    fclose(f);
+}
+
+// Remove an exited child's PCB from whichever queue holds it and finish it.
+// usage is the child's final rusage from wait4(), or NULL if unavailable.
+// Returns 1 if the PID belonged to the scheduler.
+int reap_process(int pid, const struct rusage* usage) {
+    PCB* p = pid_table_lookup(&sched.pids, pid);
+    if (!p) return 0;
+
+    if (usage) {
+        p->real_cpu_us = (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000L +
+                         usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+        p->max_rss_kb = usage->ru_maxrss;
+        p->ctx_switches = usage->ru_nvcsw + usage->ru_nivcsw;
+    }
+
+    CPU* cpu = lock_pcb_cpu(p);
+    if (p->state == PROC_WAITING) {
+        wait_heap_remove_locked(&cpu->waiting, p->heap_index);
+    }
+    sched_policy->on_exit(cpu, p);
+    if (p->state == PROC_READY) cpu->nr_ready--;
+    finish_process(p);
+    pthread_mutex_unlock(&cpu->lock);
+    return 1;
+}
+
+// File Management Functions
+uint64_t splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void random_stream_seed(RandomStream* rs, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        for (int lane = 0; lane < 8; lane++) rs->s[i][lane] = splitmix64(&seed);
+    }
+}
+
+// Fill len bytes (a multiple of 64) of a 64-byte aligned buffer
+void random_stream_fill(RandomStream* rs, unsigned char* buf, size_t len) {
+    u64x8 s0 = rs->s[0], s1 = rs->s[1], s2 = rs->s[2], s3 = rs->s[3];
+    for (size_t i = 0; i < len; i += sizeof(u64x8)) {
+        u64x8 x = s1 * 5;
+        x = ((x << 7) | (x >> 57)) * 9;
+        *(u64x8*)(buf + i) = x;
+
+        u64x8 t = s1 << 17;
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = (s3 << 45) | (s3 >> 19);
+    }
+    rs->s[0] = s0;
+    rs->s[1] = s1;
+    rs->s[2] = s2;
+    rs->s[3] = s3;
+}
+
+int write_all(int fd, const unsigned char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Create a file of size bytes. Random and pattern data are generated into
+// one reusable chunk and streamed out, so size is not limited by memory.
+void create_file(const char *path, long long size, FillMode mode, const char* pattern) {
+    static unsigned char *chunk = NULL;
+    static RandomStream stream;
+    static int stream_seeded = 0;
+    const char* mode_names[] = {"random ", "sparse ", "allocated ", "pattern "};
+
+    printf("Creating %s (%s%lld bytes)\n", path, mode_names[mode], size);
+
+    if (!chunk) {
+        chunk = aligned_alloc(sizeof(u64x8), CREATE_CHUNK);
+        if (!chunk) {
+            perror("Memory allocation failed");
+            return;
+        }
+    }
+    if (!stream_seeded) {
+        random_stream_seed(&stream, ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid() ^ (uint64_t)rand());
+        stream_seeded = 1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to create file");
+        return;
+    }
+
+    long start = get_time();
+    int rc = 0;
+    if (mode == FILL_SPARSE) {
+        rc = ftruncate(fd, size);
+    } else if (mode == FILL_ALLOC) {
+        rc = fallocate(fd, 0, 0, size);
+        if (rc != 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+            rc = posix_fallocate(fd, 0, size);  // Emulated by writing zeros
+            if (rc != 0) errno = rc;
+        }
+    } else {
+        size_t fill = CREATE_CHUNK;
+        if (mode == FILL_PATTERN) {
+            // Whole repetitions of the pattern, so chunks join seamlessly
+            size_t plen = strlen(pattern);
+            fill = CREATE_CHUNK / plen * plen;
+            for (size_t i = 0; i < fill; i += plen) memcpy(chunk + i, pattern, plen);
+        }
+        for (long long left = size; left > 0 && rc == 0; ) {
+            size_t n = left < (long long)fill ? (size_t)left : fill;
+            if (mode == FILL_RANDOM) {
+                random_stream_fill(&stream, chunk, (n + sizeof(u64x8) - 1) & ~(sizeof(u64x8) - 1));
+            }
+            rc = write_all(fd, chunk, n);
+            left -= n;
+        }
+    }
+    if (rc != 0) perror("Failed to fill file");
+    if (close(fd) != 0 && rc == 0) perror("Failed to close file");
+
+    long elapsed = get_time() - start;
+    if (rc == 0 && (mode == FILL_RANDOM || mode == FILL_PATTERN) && size >= 64LL * CREATE_CHUNK && elapsed > 0) {
+        printf("  %lld MB in %ld.%03ld s (%.0f MB/s)\n", size >> 20, elapsed / 1000000,
+               (elapsed / 1000) % 1000, (double)size / (1 << 20) * 1e6 / elapsed);
+    }
+}
+
+void modify_file(const char *path) {
+    printf("Modifying %s\n", path);
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        perror("Failed to open file for modification");
+        return;
+    }
+    fprintf(file, "Appended content to the file.\n");
+    fclose(file);
+}
+
+void delete_file(const char *path) {
+    printf("Deleting %s\n", path);
+    if (remove(path) != 0) {
+        perror("Failed to delete file");
+    }
+}
+
+void get_file_info(const char *path, int detailed) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror("Error getting file info");
+        return;
+    }
+
+    printf("\nInformation for: %s\n", path);
+    printf("Type: Regular File\n");
+    printf("Size: %ld bytes\n", st.st_size);
+    printf("Permissions: %o\n", st.st_mode & 0777);
+    printf("Last modified: %s", ctime(&st.st_mtime));
+
+    if (detailed) {
+        printf("\n-- Detailed Information --\n");
+        printf("Inode: %ld\n", st.st_ino);
+        printf("Hard Links: %ld\n", st.st_nlink);
+        printf("Owner UID: %d\n", st.st_uid);
+        printf("Group GID: %d\n", st.st_gid);
+        printf("Device: %ld\n", st.st_dev);
+        printf("Last access: %s", ctime(&st.st_atime));
+        printf("Last status change: %s", ctime(&st.st_ctime));
+    }
+    printf("\n");
+}
+
+// Parallel directory walker
+int walk_path(const WalkEntry* e, char* buf, size_t size) {
+    return snprintf(buf, size, "%s/%s", e->dir->path, e->name) < (int)size ? 0 : -1;
+}
+
+int walk_push(Walker* w, int self, WalkDir* dir) {
+    WalkQueue* q = &w->queues[self];
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->cap) {
+        int new_cap = q->cap ? q->cap * 2 : 64;
+        WalkDir** items = malloc(new_cap * sizeof(WalkDir*));
+        if (!items) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        for (int i = 0; i < q->count; i++) items[i] = q->items[(q->head + i) % q->cap];
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->cap = new_cap;
+    }
+    q->items[(q->head + q->count) % q->cap] = dir;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&w->lock);
+    w->queued++;
+    w->pending++;
+    if (w->idle > 0) pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+// Own work comes off the tail (depth first), stolen work off the head
+WalkDir* walk_take(WalkQueue* q, int from_tail) {
+    WalkDir* dir = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        if (from_tail) {
+            dir = q->items[(q->head + q->count - 1) % q->cap];
+        } else {
+            dir = q->items[q->head];
+            q->head = (q->head + 1) % q->cap;
+        }
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return dir;
+}
+
+WalkDir* walk_next(Walker* w, int self) {
+    for (;;) {
+        WalkDir* dir = walk_take(&w->queues[self], 1);
+        for (int i = 1; !dir && i < w->threads; i++) {
+            dir = walk_take(&w->queues[(self + i) % w->threads], 0);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (dir) {
+            w->queued--;
+            pthread_mutex_unlock(&w->lock);
+            return dir;
+        }
+        if (w->pending == 0) {
+            pthread_mutex_unlock(&w->lock);
+            return NULL;
+        }
+        if (w->queued <= 0) {
+            w->idle++;
+            pthread_cond_wait(&w->wake, &w->lock);
+            w->idle--;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+// Drop one reference; the last one leaves the directory and releases its parent
+void walk_release(Walker* w, WalkDir* dir) {
+    while (dir) {
+        pthread_mutex_lock(&w->lock);
+        int refs = --dir->refs;
+        pthread_mutex_unlock(&w->lock);
+        if (refs > 0) return;
+
+        WalkDir* parent = dir->parent;
+        if (w->leave) w->leave(w, dir);
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+void walk_scan(Walker* w, int self, WalkDir* dir, char* buf) {
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (dir->depth > 0 ? O_NOFOLLOW : 0));
+    if (fd < 0) {
+        if (errno != EACCES) fprintf(stderr, "%s: %s: %s\n", w->errors_as, dir->path, strerror(errno));
+        pthread_mutex_lock(&w->lock);
+        w->errors++;
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+
+    long entries = 0;
+    ssize_t n;
+    while ((n = getdents64(fd, buf, WALK_BUF)) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            struct dirent64* d = (struct dirent64*)(buf + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+                (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+
+            WalkEntry e = {dir, fd, d->d_name, d->d_type, NULL};
+            if (e.type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) e.type = IFTODT(st.st_mode);
+            }
+            entries++;
+            if (!w->visit(w, &e) || e.type != DT_DIR) continue;
+            if (w->max_depth > 0 && dir->depth + 1 >= w->max_depth) continue;
+
+            WalkDir* child = malloc(sizeof(WalkDir));
+            size_t len = strlen(dir->path) + strlen(d->d_name) + 2;
+            char* path = child ? malloc(len) : NULL;
+            if (!path) {
+                free(child);
+                fprintf(stderr, "%s: %s/%s: %s\n", w->errors_as, dir->path, d->d_name, strerror(ENOMEM));
+                continue;
+            }
+            snprintf(path, len, "%s/%s", dir->path, d->d_name);
+            *child = (WalkDir){path, dir->depth + 1, e.child_ctx, dir, 1};
+
+            pthread_mutex_lock(&w->lock);
+            dir->refs++;
+            pthread_mutex_unlock(&w->lock);
+            if (walk_push(w, self, child) != 0) {
+                // Never queued: treat as visited and left empty
+                walk_release(w, child);
+            }
+        }
+    }
+    if (n < 0) fprintf(stderr, "%s: %s: %s\n", w->errors_as, dir->path, strerror(errno));
+    close(fd);
+
+    pthread_mutex_lock(&w->lock);
+    w->dirs++;
+    w->entries += entries;
+    if (n < 0) w->errors++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+void* walk_thread(void* arg) {
+    WalkThread* t = arg;
+    Walker* w = t->w;
+    char* buf = malloc(WALK_BUF);
+    WalkDir* dir;
+    while ((dir = walk_next(w, t->self)) != NULL) {
+        if (buf && !(w->cancel && *w->cancel)) {
+            walk_scan(w, t->self, dir, buf);
+        }
+        walk_release(w, dir);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->pending == 0) pthread_cond_broadcast(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Walk everything below root. The caller fills in visit, leave, arg,
+// max_depth and errors_as; root_ctx becomes the root WalkDir's ctx.
+// Returns -1 if the walk could not start.
+int walk_tree(Walker* w, const char* root, void* root_ctx) {
+    WalkDir* dir = malloc(sizeof(WalkDir));
+    char* path = dir ? strdup(root) : NULL;
+    if (!path) {
+        free(dir);
+        return -1;
+    }
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') path[--len] = '\0';
+    *dir = (WalkDir){path, 0, root_ctx, NULL, 1};
+
+    w->threads = WALK_THREADS;
+    w->queued = w->pending = w->idle = 0;
+    w->dirs = w->entries = w->errors = 0;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->result_lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    for (int i = 0; i < w->threads; i++) {
+        w->queues[i] = (WalkQueue){NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    }
+
+    int rc = 0;
+    if (walk_push(w, 0, dir) != 0) {
+        free(path);
+        free(dir);
+        rc = -1;
+    } else {
+        // The calling thread is walker thread 0
+        pthread_t threads[WALK_THREADS];
+        WalkThread args[WALK_THREADS];
+        int started = 1;
+        for (int i = 0; i < w->threads; i++) args[i] = (WalkThread){w, i};
+        for (; started < w->threads; started++) {
+            if (pthread_create(&threads[started], NULL, walk_thread, &args[started]) != 0) break;
+        }
+        walk_thread(&args[0]);
+        for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < w->threads; i++) {
+        free(w->queues[i].items);
+        pthread_mutex_destroy(&w->queues[i].lock);
+    }
+    pthread_cond_destroy(&w->wake);
+    pthread_mutex_destroy(&w->result_lock);
+    pthread_mutex_destroy(&w->lock);
+    return rc;
+}
+
+void create_directory(const char *path) {
+    if (mkdir(path, 0755) == 0) {
+        printf("Directory '%s' created successfully.\n", path);
+    } else {
+        perror("newdir failed");
+    }
+}
+
+int delete_visit(Walker* w, WalkEntry* e) {
+    (void)w;
+    if (e->type == DT_DIR) return 1;
+    unlinkat(e->dir_fd, e->name, 0);
+    return 0;
+}
+
+// Children are all gone by the time a directory is left
+void delete_leave(Walker* w, WalkDir* dir) {
+    (void)w;
+    if (dir->depth > 0) rmdir(dir->path);
+}
+
+void delete_directory_contents(const char *path) {
+    Walker w = {0};
+    w.visit = delete_visit;
+    w.leave = delete_leave;
+    w.errors_as = "Failed to open directory";
+    if (walk_tree(&w, path, NULL) != 0) perror("killdir");
+}
+
+void delete_directory(const char *path, int recursive) {
+    if (recursive) {
+        delete_directory_contents(path);
+    }
+
+    if (rmdir(path) == 0) {
+        printf("Directory '%s' deleted successfully.\n", path);
+    } else {
+        if (recursive) {
+            perror("Failed to delete directory (even with -r)");
+        } else {
+            printf("Directory not empty. Use -r to delete recursively.\n");
+        }
+    }
+}
+
+typedef struct {
+    long files;
+    long dirs;
+    long long bytes;
+} DirCounts;
+
+// dinf -d: symlinks count as what they point to
+int dinf_visit(Walker* w, WalkEntry* e) {
+    DirCounts* counts = w->arg;
     struct stat st;
-    if (stat(path, &st) != 0) {
-        perror("Error getting file info");
+    int is_dir = e->type == DT_DIR;
+    off_t size = 0;
+    if (!is_dir) {
+        if (fstatat(e->dir_fd, e->name, &st, 0) != 0) return 0;
+        is_dir = S_ISDIR(st.st_mode);
+        size = st.st_size;
+    }
+
+    pthread_mutex_lock(&w->result_lock);
+    if (is_dir) {
+        counts->dirs++;
+    } else {
+        counts->files++;
+        counts->bytes += size;
+    }
+    pthread_mutex_unlock(&w->result_lock);
+    return 0;
+}
+
+// tree collects the whole listing in parallel, then prints it in
+// directory order
+typedef struct TreeNode {
+    char* name;
+    struct TreeNode** children;
+    int num_children;
+    int cap;
+} TreeNode;
+
+// Only the thread scanning a directory touches its node
+int tree_visit(Walker* w, WalkEntry* e) {
+    (void)w;
+    TreeNode* parent = e->dir->ctx;
+    TreeNode* node = calloc(1, sizeof(TreeNode));
+    if (!node || !(node->name = strdup(e->name))) {
+        free(node);
+        return 0;
+    }
+    if (parent->num_children == parent->cap) {
+        int new_cap = parent->cap ? parent->cap * 2 : 8;
+        TreeNode** grown = realloc(parent->children, new_cap * sizeof(TreeNode*));
+        if (!grown) {
+            free(node->name);
+            free(node);
+            return 0;
+        }
+        parent->children = grown;
+        parent->cap = new_cap;
+    }
+    parent->children[parent->num_children++] = node;
+    e->child_ctx = node;
+    return 1;
+}
+
+void tree_print(TreeNode* node, int depth) {
+    for (int i = 0; i < node->num_children; i++) {
+        TreeNode* child = node->children[i];
+        for (int j = 0; j < depth; j++)
+            printf("│   ");
+        printf("├── %s\n", child->name);
+        tree_print(child, depth + 1);
+        free(child->name);
+        free(child);
+    }
+    free(node->children);
+}
+
+void printTree(const char *base_path) {
+    TreeNode root = {0};
+    Walker w = {0};
+    w.visit = tree_visit;
+    w.errors_as = "opendir failed";
+    if (walk_tree(&w, base_path, &root) != 0) {
+        perror("tree");
         return;
     }
+    tree_print(&root, 0);
+}
 
-    printf("\nInformation for: %s\n", path);
-    printf("Type: Regular File\n");
-    printf("Size: %ld bytes\n", st.st_size);
-    printf("Permissions: %o\n", st.st_mode & 0777);
-    printf("Last modified: %s", ctime(&st.st_mtime));
+void renameItem(const char *oldName, const char *newName) {
+    if (rename(oldName, newName) == 0) {
+        printf("Renamed '%s' to '%s'\n", oldName, newName);
+    } else {
+        perror("rename failed");
+    }
+}
 
-    if (detailed) {
-        printf("\n-- Detailed Information --\n");
-        printf("Inode: %ld\n", st.st_ino);
-        printf("Hard Links: %ld\n", st.st_nlink);
-        printf("Owner UID: %d\n", st.st_uid);
-        printf("Group GID: %d\n", st.st_gid);
-        printf("Device: %ld\n", st.st_dev);
-        printf("Last access: %s", ctime(&st.st_atime));
-        printf("Last status change: %s", ctime(&st.st_ctime));
+void moveItem(const char *item, const char *newPath) {
+    const char *filename = strrchr(item, '/');
+    filename = (filename == NULL) ? item : filename + 1;
+
+    char fullDestPath[1024];
+    snprintf(fullDestPath, sizeof(fullDestPath), "%s/%s", newPath, filename);
+
+    if (rename(item, fullDestPath) == 0) {
+        printf("Moved '%s' to '%s'\n", item, fullDestPath);
+    } else {
+        perror("move failed");
+    }
+}
+
+const char *get_basename(const char *path) {
+    const char *last_slash = strrchr(path, '/');
+    return last_slash ? last_slash + 1 : path;
+}
+
+// Copy the contents of in to out. Reflink if the filesystem can share
+// extents, then copy_file_range (in-kernel, may offload), then sendfile,
+// then plain read/write.
+int copy_file_data(int in, int out, off_t size) {
+    if (size > 0 && ioctl(out, FICLONE, in) == 0) return 0;
+
+    off_t done = 0;
+    int method = 0;  // 0 copy_file_range, 1 sendfile, 2 read/write
+    char buf[65536];
+    while (done < size) {
+        ssize_t n;
+        size_t want = size - done > (1 << 30) ? (1 << 30) : (size_t)(size - done);
+        if (method == 0) {
+            n = copy_file_range(in, NULL, out, NULL, want, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                          errno == EOPNOTSUPP) && done == 0) {
+                method = 1;
+                continue;
+            }
+        } else if (method == 1) {
+            n = sendfile(out, in, NULL, want);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS) && done == 0) {
+                method = 2;
+                continue;
+            }
+        } else {
+            n = read(in, buf, want < sizeof(buf) ? want : sizeof(buf));
+            if (n > 0 && write_all(out, (unsigned char*)buf, n) != 0) return -1;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;  // Source shrank under us
+        done += n;
+    }
+    return 0;
+}
+
+// Copy one non-directory. dst must not exist; flags adds O_EXCL for the
+// top-level copy so name probing and creation are one step.
+int copy_entry(const char* src, const char* dst, const struct stat* st, int flags) {
+    if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(src, target, sizeof(target) - 1);
+        if (len < 0) return -1;
+        target[len] = '\0';
+        struct timespec times[2] = {st->st_atim, st->st_mtim};
+        if (symlink(target, dst) != 0) return -1;
+        utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);  // Best effort
+        return 0;
+    }
+    if (!S_ISREG(st->st_mode)) {
+        errno = ENOTSUP;  // Devices, fifos and sockets are not copied
+        return -1;
+    }
+
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | flags, 0600);
+    if (out < 0) {
+        int err = errno;
+        close(in);
+        errno = err;
+        return -1;
+    }
+
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    int rc = copy_file_data(in, out, st->st_size);
+    if (rc == 0) rc = fchmod(out, st->st_mode & 07777);
+    if (rc == 0) rc = futimens(out, times);
+    if (close(out) != 0 && rc == 0) rc = -1;
+    int err = errno;
+    close(in);
+    if (rc != 0) unlink(dst);  // No partial copies
+    errno = err;
+    return rc;
+}
+
+typedef struct {
+    char* dst;
+    struct stat st;
+} CopyDir;
+
+typedef struct {
+    long files;
+    long long bytes;
+    long errors;
+    dev_t dst_dev;          // The copy itself, if it lies inside the source
+    ino_t dst_ino;
+} CopyTotals;
+
+// Directories are created on the way down, owner-writable; files are
+// copied by whichever walker thread finds them
+int copy_visit(Walker* w, WalkEntry* e) {
+    CopyTotals* totals = w->arg;
+    CopyDir* parent = e->dir->ctx;
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    struct stat st;
+    const char* failed = src;
+    int err = ENAMETOOLONG;
+    CopyDir* child = NULL;
+
+    if (walk_path(e, src, sizeof(src)) != 0 ||
+        snprintf(dst, sizeof(dst), "%s/%s", parent->dst, e->name) >= (int)sizeof(dst)) {
+        goto fail;
+    }
+    if (fstatat(e->dir_fd, e->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        err = errno;
+        goto fail;
+    }
+    if (S_ISDIR(st.st_mode) && st.st_dev == totals->dst_dev && st.st_ino == totals->dst_ino) {
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (copy_entry(src, dst, &st, 0) != 0) {
+            err = errno;
+            goto fail;
+        }
+        pthread_mutex_lock(&w->result_lock);
+        totals->files++;
+        if (S_ISREG(st.st_mode)) totals->bytes += st.st_size;
+        pthread_mutex_unlock(&w->result_lock);
+        return 0;
     }
+
+    failed = dst;
+    child = malloc(sizeof(CopyDir));
+    if (!child || !(child->dst = strdup(dst))) {
+        err = ENOMEM;
+        free(child);
+        goto fail;
+    }
+    if (mkdir(dst, 0700) != 0) {
+        err = errno;
+        free(child->dst);
+        free(child);
+        goto fail;
+    }
+    child->st = st;
+    e->child_ctx = child;
+    return 1;
+
+fail:
+    fprintf(stderr, "copy: %s: %s\n", failed, strerror(err));
+    pthread_mutex_lock(&w->result_lock);
+    totals->errors++;
+    pthread_mutex_unlock(&w->result_lock);
+    return 0;
+}
+
+// Everything below is copied; setting the mode and mtime is the last change
+void copy_leave(Walker* w, WalkDir* dir) {
+    CopyTotals* totals = w->arg;
+    CopyDir* copy = dir->ctx;
+    struct timespec times[2] = {copy->st.st_atim, copy->st.st_mtim};
+    if (chmod(copy->dst, copy->st.st_mode & 07777) != 0 ||
+        utimensat(AT_FDCWD, copy->dst, times, 0) != 0) {
+        fprintf(stderr, "copy: %s: %s\n", copy->dst, strerror(errno));
+        pthread_mutex_lock(&w->result_lock);
+        totals->errors++;
+        pthread_mutex_unlock(&w->result_lock);
+    }
+    if (dir->depth > 0) {
+        free(copy->dst);
+        free(copy);
+    }
+}
+
+// Copy directory src to the already created directory dst
+void copy_tree(const char* src, const char* dst, const struct stat* st) {
+    CopyTotals totals = {0};
+    CopyDir root = {(char*)dst, *st};
+    Walker w = {0};
+    w.visit = copy_visit;
+    w.leave = copy_leave;
+    w.arg = &totals;
+    w.errors_as = "copy";
+    long start = get_time();
+
+    struct stat dst_st;
+    if (stat(dst, &dst_st) == 0) {
+        totals.dst_dev = dst_st.st_dev;
+        totals.dst_ino = dst_st.st_ino;
+    }
+    if (walk_tree(&w, src, &root) != 0) {
+        perror("copy");
+        return;
+    }
+    printf("  %ld files, %ld directories, %lld bytes in %ld ms", totals.files, w.dirs,
+           totals.bytes, (get_time() - start) / 1000);
+    if (totals.errors + w.errors) printf(", %ld errors", totals.errors + w.errors);
     printf("\n");
 }
 
-void create_directory(const char *path) {
-    if (mkdir(path, 0755) == 0) {
-        printf("Directory '%s' created successfully.\n", path);
+// Copy path to "name(N).ext" in the current directory, for the first N not
+// taken. The name is claimed by creating it (O_EXCL/mkdir), not probed.
+void auto_copy(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror("Error checking path");
+        return;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        printf("copy: %s is not a file or directory\n", path);
+        return;
+    }
+
+    char newname[256];
+    const char *base = get_basename(path);
+    const char *dot = strrchr(base, '.');
+    int rc = -1;
+
+    for (int counter = 1; counter <= COPY_MAX_NAMES; counter++) {
+        if (dot && S_ISREG(st.st_mode)) {
+            snprintf(newname, sizeof(newname), "%.*s(%d)%s",
+                    (int)(dot - base), base, counter, dot);
+        } else {
+            snprintf(newname, sizeof(newname), "%s(%d)", base, counter);
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            rc = mkdir(newname, 0700);
+        } else {
+            rc = copy_entry(path, newname, &st, O_EXCL);
+        }
+        if (rc == 0 || errno != EEXIST) break;
+    }
+
+    if (rc != 0) {
+        perror("copy failed");
+        return;
+    }
+    printf("Created copy: %s\n", newname);
+    if (S_ISDIR(st.st_mode)) {
+        copy_tree(path, newname, &st);
+    }
+}
+
+// search predicates; every one given must hold
+typedef struct {
+    const char* name;       // Basename, a glob if it has wildcards
+    int glob;
+    regex_t regex;          // -r, on the basename
+    int use_regex;
+    long long size;         // -size [+-]N: compare sign, 0 for exactly N
+    int size_cmp;
+    int use_size;
+    long age;               // -mtime [+-]N[smhd]: age in seconds, same signs
+    int age_cmp;
+    long age_unit;          // Without a sign, age must fall in [age, age + unit)
+    int use_age;
+    time_t now;
+    const char* content;    // --content: regular files containing this text
+    size_t content_len;
+    int found;
+} SearchQuery;
+
+#ifdef __SSE2__
+// Two-byte prefilter: candidate positions are those where both the first
+// and the last needle byte match; only candidates are compared in full.
+// Both scan from *pos (needle length m >= 2) and leave *pos where they
+// stopped, for the scalar tail.
+__attribute__((target("avx2")))
+const char* find_text_avx2(const char* hay, size_t n, const char* needle, size_t m, size_t* pos) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = *pos;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    *pos = i;
+    return NULL;
+}
+
+const char* find_text_sse2(const char* hay, size_t n, const char* needle, size_t m, size_t* pos) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = *pos;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    *pos = i;
+    return NULL;
+}
+#endif
+
+// First occurrence of needle in hay. Uses AVX2 (32 positions per step)
+// when the CPU has it, checked once at runtime, otherwise SSE2 (16).
+const char* find_text(const char* hay, size_t n, const char* needle, size_t m) {
+    if (m == 0) return hay;
+    if (m > n) return NULL;
+    if (m == 1) return memchr(hay, needle[0], n);
+
+    size_t i = 0;
+#ifdef __SSE2__
+    static int use_avx2 = -1;  // Same answer on every thread, so the race is benign
+    if (use_avx2 < 0) use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    const char* hit = use_avx2 ? find_text_avx2(hay, n, needle, m, &i)
+                               : find_text_sse2(hay, n, needle, m, &i);
+    if (hit) return hit;
+#endif
+    // Tail, or the whole buffer without SIMD
+    while (i + m <= n) {
+        const char* p = memchr(hay + i, needle[0], n - m + 1 - i);
+        if (!p) return NULL;
+        if (p[m - 1] == needle[m - 1] && memcmp(p + 1, needle + 1, m - 2) == 0) return p;
+        i = p - hay + 1;
+    }
+    return NULL;
+}
+
+// Line number of the first match of the query text in file, or 0
+long search_content(int dir_fd, const char* name, off_t size, const SearchQuery* q) {
+    if (size < (off_t)q->content_len || size == 0) return 0;
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return 0;
+    const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+
+    long line = 0;
+    const char* hit = find_text(data, size, q->content, q->content_len);
+    if (hit) {
+        line = 1;
+        for (const char* p = data; (p = memchr(p, '\n', hit - p)) != NULL; p++) line++;
+    }
+    munmap((void*)data, size);
+    return line;
+}
+
+int search_compare(long long value, long long target, int cmp) {
+    return cmp > 0 ? value > target : cmp < 0 ? value < target : value == target;
+}
+
+int search_visit(Walker* w, WalkEntry* e) {
+    SearchQuery* q = w->arg;
+    if (q->name && (q->glob ? fnmatch(q->name, e->name, 0) != 0 : strcmp(e->name, q->name) != 0)) {
+        return 1;
+    }
+    if (q->use_regex && regexec(&q->regex, e->name, 0, NULL, 0) != 0) return 1;
+
+    long line = 0;
+    if (q->use_size || q->use_age || q->content) {
+        if (q->content && e->type != DT_REG) return 1;
+        struct stat st;
+        if (fstatat(e->dir_fd, e->name, &st, AT_SYMLINK_NOFOLLOW) != 0) return 1;
+        if (q->use_size && !search_compare(st.st_size, q->size, q->size_cmp)) return 1;
+        if (q->use_age) {
+            long age = q->now - st.st_mtime;
+            if (q->age_cmp == 0 ? (age < q->age || age >= q->age + q->age_unit)
+                                : !search_compare(age, q->age, q->age_cmp)) {
+                return 1;
+            }
+        }
+        if (q->content && (!S_ISREG(st.st_mode) || (line = search_content(e->dir_fd, e->name, st.st_size, q)) == 0)) {
+            return 1;
+        }
+    }
+
+    char path[PATH_MAX];
+    walk_path(e, path, sizeof(path));
+    pthread_mutex_lock(&w->result_lock);
+    if (line) {
+        printf("Found: %s:%ld\n", path, line);
     } else {
-        perror("newdir failed");
+        printf("Found: %s\n", path);
     }
+    q->found++;
+    pthread_mutex_unlock(&w->result_lock);
+    return 1;
 }
 
-void delete_directory_contents(const char *path) {
-    DIR *dir = opendir(path);
-    if (!dir) {
-        perror("Failed to open directory");
-        return;
+int search_file(const char *dir_path, SearchQuery* q, int *found) {
+    Walker w = {0};
+    w.visit = search_visit;
+    w.arg = q;
+    w.errors_as = "Failed to open directory";
+    q->found = 0;
+    if (walk_tree(&w, dir_path, NULL) != 0) {
+        perror("search");
     }
+    *found += q->found;
+    return q->found;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+// "+N", "-N" or "N" with an optional unit; sets *cmp to the sign
+int parse_predicate(const char* arg, int* cmp, const char* units, const long* scale, long long* value,
+                    long* unit) {
+    *cmp = *arg == '+' ? 1 : *arg == '-' ? -1 : 0;
+    if (*cmp) arg++;
+    char* end;
+    errno = 0;
+    long long n = strtoll(arg, &end, 10);
+    if (errno || end == arg || n < 0) return -1;
+    long mult = scale[0];
+    if (*end) {
+        const char* u = strchr(units, *end);
+        if (!u || end[1]) return -1;
+        mult = scale[u - units + 1];
+    }
+    if (n > LLONG_MAX / mult) return -1;
+    *value = n * mult;
+    if (unit) *unit = mult;
+    return 0;
+}
+
+// Filename index
+void index_path_file(char* buf, size_t size) {
+    const char* home = getenv("HOME");
+    snprintf(buf, size, "%s/%s", home && home[0] ? home : "/tmp", INDEX_FILE);
+}
+
+// Record rel as the path of watch descriptor wd. Caller serializes.
+void index_set_watch(int wd, const char* rel) {
+    if (wd >= file_index.watch_cap) {
+        int new_cap = file_index.watch_cap ? file_index.watch_cap : 256;
+        while (new_cap <= wd) new_cap *= 2;
+        char** grown = realloc(file_index.watch_paths, new_cap * sizeof(char*));
+        if (!grown) return;
+        memset(grown + file_index.watch_cap, 0, (new_cap - file_index.watch_cap) * sizeof(char*));
+        file_index.watch_paths = grown;
+        file_index.watch_cap = new_cap;
+    }
+    char* copy = strdup(rel);
+    if (!copy) return;
+    if (file_index.watch_paths[wd]) {
+        free(file_index.watch_paths[wd]);
+    } else {
+        file_index.watches++;
+    }
+    file_index.watch_paths[wd] = copy;
+}
+
+void index_watch(const char* path, const char* rel) {
+    if (file_index.inotify_fd < 0) return;
+    int wd = inotify_add_watch(file_index.inotify_fd, path, INDEX_WATCH_MASK);
+    if (wd >= 0) {
+        index_set_watch(wd, rel);
+    } else if (errno == ENOSPC) {
+        file_index.watch_full = 1;
+    }
+}
+
+int index_visit(Walker* w, WalkEntry* e) {
+    IndexBuild* b = w->arg;
+    char path[PATH_MAX];
+    if (walk_path(e, path, sizeof(path)) != 0) return 0;
+    const char* rel = path + b->root_len;
+    while (*rel == '/') rel++;
+    char* copy = strdup(rel);
+    if (!copy) return 0;
+
+    pthread_mutex_lock(&w->result_lock);
+    if (b->count == b->cap) {
+        long new_cap = b->cap ? b->cap * 2 : 4096;
+        char** grown = realloc(b->paths, new_cap * sizeof(char*));
+        if (!grown) {
+            pthread_mutex_unlock(&w->result_lock);
+            free(copy);
+            return 0;
+        }
+        b->paths = grown;
+        b->cap = new_cap;
+    }
+    b->paths[b->count++] = copy;
+    if (b->watch && e->type == DT_DIR) index_watch(path, copy);
+    pthread_mutex_unlock(&w->result_lock);
+    return 1;
+}
+
+// Collect every path below dir (which lies in the indexed root)
+int index_collect(IndexBuild* b, const char* dir) {
+    Walker w = {0};
+    w.visit = index_visit;
+    w.arg = b;
+    w.errors_as = "search --index";
+    w.cancel = &file_index.stopping;
+    if (walk_tree(&w, dir, NULL) != 0) return -1;
+    if (w.dirs == 0) {
+        errno = ENOENT;  // Could not read dir itself; already reported
+        return -1;
+    }
+    if (file_index.stopping) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+void index_free_paths(IndexBuild* b) {
+    for (long i = 0; i < b->count; i++) free(b->paths[i]);
+    free(b->paths);
+    b->paths = NULL;
+    b->count = b->cap = 0;
+}
+
+// Path order with '/' lowest, so a directory is followed by its subtree
+int index_path_cmp(const void* a, const void* b) {
+    const unsigned char* x = *(const unsigned char* const*)a;
+    const unsigned char* y = *(const unsigned char* const*)b;
+    while (*x && *x == *y) {
+        x++;
+        y++;
+    }
+    int cx = *x == '/' ? 1 : (*x ? *x + 1 : 0);
+    int cy = *y == '/' ? 1 : (*y ? *y + 1 : 0);
+    return cx - cy;
+}
+
+const char* index_basename(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+char** index_sort_paths;  // qsort has no context argument
+
+int index_name_cmp(const void* a, const void* b) {
+    const char* x = index_sort_paths[*(const uint32_t*)a];
+    const char* y = index_sort_paths[*(const uint32_t*)b];
+    int c = strcmp(index_basename(x), index_basename(y));
+    return c ? c : index_path_cmp(&x, &y);
+}
+
+// Write the index for root to file (via a temporary and rename)
+int index_write(const char* file, const char* root, char** paths, long n) {
+    if (n >= INDEX_ROOT) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (n > 0) qsort(paths, n, sizeof(char*), index_path_cmp);
+
+    // Parents by path order: the parent is the nearest directory on the stack
+    uint32_t* parent = malloc(n * sizeof(uint32_t) + 1);
+    uint32_t* stack = malloc(n * sizeof(uint32_t) + 1);
+    uint32_t* order = malloc(n * sizeof(uint32_t) + 1);
+    uint32_t* final = malloc(n * sizeof(uint32_t) + 1);
+    int rc = -1;
+    FILE* out = NULL;
+    char tmp[PATH_MAX + 8];
+    if (!parent || !stack || !order || !final) goto done;
+
+    long sp = 0;
+    for (long i = 0; i < n; i++) {
+        size_t plen = index_basename(paths[i]) - paths[i];
+        plen = plen ? plen - 1 : 0;
+        while (sp > 0) {
+            const char* top = paths[stack[sp - 1]];
+            size_t len = strlen(top);
+            if (len < strlen(paths[i]) && strncmp(top, paths[i], len) == 0 && paths[i][len] == '/') break;
+            sp--;
+        }
+        parent[i] = (sp > 0 && strlen(paths[stack[sp - 1]]) == plen) ? stack[sp - 1] : INDEX_ROOT;
+        stack[sp++] = i;
+        order[i] = i;
+    }
+
+    index_sort_paths = paths;
+    if (n > 0) qsort(order, n, sizeof(uint32_t), index_name_cmp);
+    for (long i = 0; i < n; i++) final[order[i]] = i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    out = fopen(tmp, "w");
+    if (!out) goto done;
+
+    index_header_t hdr = {{0}, INDEX_VERSION, (uint32_t)n, (uint32_t)strlen(root), 0, (int64_t)time(NULL)};
+    memcpy(hdr.magic, INDEX_MAGIC, 4);
+    for (long i = 0; i < n; i++) hdr.names_size += strlen(index_basename(paths[i])) + 1;
+    static const char pad[8] = {0};
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fwrite(root, 1, hdr.root_len, out);
+    fwrite(pad, 1, (8 - hdr.root_len % 8) % 8, out);
+
+    uint64_t off = 0;
+    for (long i = 0; i < n; i++) {
+        uint32_t p = parent[order[i]];
+        index_entry_t entry = {(uint32_t)off, p == INDEX_ROOT ? INDEX_ROOT : final[p]};
+        fwrite(&entry, sizeof(entry), 1, out);
+        off += strlen(index_basename(paths[order[i]])) + 1;
+    }
+    for (long i = 0; i < n; i++) {
+        const char* name = index_basename(paths[order[i]]);
+        fwrite(name, 1, strlen(name) + 1, out);
+    }
+    if (off >= UINT32_MAX) {
+        errno = EFBIG;
+    } else if (fflush(out) == 0 && !ferror(out)) {
+        rc = 0;
+    }
+
+done:
+    if (out && fclose(out) != 0) rc = -1;
+    if (out && rc == 0 && rename(tmp, file) != 0) rc = -1;
+    if (out && rc != 0) unlink(tmp);
+    free(parent);
+    free(stack);
+    free(order);
+    free(final);
+    return rc;
+}
+
+void index_clear_delta() {
+    for (int i = 0; i < file_index.delta_cap; i++) {
+        free(file_index.delta[i].path);
+        file_index.delta[i] = (IndexChange){0};
+    }
+    file_index.delta_count = 0;
+    file_index.changes = 0;
+}
+
+// Map file as the index, replacing the current one. Index lock held.
+int index_load_locked(const char* file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(index_header_t)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const index_header_t* hdr = map;
+    size_t root_size = (hdr->root_len + 7) & ~7UL;
+    size_t need = sizeof(*hdr) + root_size + (size_t)hdr->count * sizeof(index_entry_t) + hdr->names_size;
+    if (memcmp(hdr->magic, INDEX_MAGIC, 4) != 0 || hdr->version != INDEX_VERSION ||
+        hdr->root_len == 0 || hdr->root_len >= PATH_MAX || need != (size_t)st.st_size ||
+        (hdr->names_size > 0 && ((const char*)map)[need - 1] != '\0')) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    const index_entry_t* entries = (const index_entry_t*)((const char*)map + sizeof(*hdr) + root_size);
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        if (entries[i].name_off >= hdr->names_size ||
+            (entries[i].parent != INDEX_ROOT && entries[i].parent >= hdr->count)) {
+            munmap(map, st.st_size);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if (file_index.map) munmap(file_index.map, file_index.map_size);
+    file_index.map = map;
+    file_index.map_size = st.st_size;
+    file_index.hdr = hdr;
+    memcpy(file_index.root, (const char*)map + sizeof(*hdr), hdr->root_len);
+    file_index.root[hdr->root_len] = '\0';
+    file_index.entries = entries;
+    file_index.names = (const char*)(file_index.entries + hdr->count);
+    return 0;
+}
+
+// Relative path of entry i
+int index_entry_path(uint32_t i, char* buf, size_t size) {
+    uint32_t chain[PATH_MAX / 2];
+    int depth = 0;
+    for (uint32_t e = i; e != INDEX_ROOT && depth < PATH_MAX / 2; e = file_index.entries[e].parent) {
+        if (e >= file_index.hdr->count) return -1;
+        chain[depth++] = e;
+    }
+    size_t len = 0;
+    for (int d = depth - 1; d >= 0; d--) {
+        const char* name = file_index.names + file_index.entries[chain[d]].name_off;
+        int n = snprintf(buf + len, size - len, "%s%s", len ? "/" : "", name);
+        if (n < 0 || (size_t)n >= size - len) return -1;
+        len += n;
+    }
+    return 0;
+}
+
+// First entry whose name is >= key (or, with prefix, does not start with key)
+uint32_t index_bound(const char* key, int past_prefix) {
+    uint32_t lo = 0, hi = file_index.hdr->count;
+    size_t key_len = strlen(key);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const char* name = file_index.names + file_index.entries[mid].name_off;
+        int c = past_prefix ? strncmp(name, key, key_len) : strcmp(name, key);
+        if (c < 0 || (past_prefix && c == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+    return lo;
+}
+
+uint32_t index_hash(const char* path, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)path[i]) * 16777619u;
+    return h;
+}
+
+// Delta entry for the first len bytes of path, added if create is set.
+// Index lock held.
+IndexChange* index_delta_find(const char* path, size_t len, int create) {
+    uint32_t h = index_hash(path, len);
+    if (file_index.delta_cap > 0) {
+        uint32_t mask = file_index.delta_cap - 1;
+        for (uint32_t i = h & mask; file_index.delta[i].path; i = (i + 1) & mask) {
+            IndexChange* c = &file_index.delta[i];
+            if (c->hash == h && strncmp(c->path, path, len) == 0 && c->path[len] == '\0') return c;
+        }
+    }
+    if (!create) return NULL;
+
+    if ((file_index.delta_count + 1) * 2 > file_index.delta_cap) {
+        int new_cap = file_index.delta_cap ? file_index.delta_cap * 2 : 256;
+        IndexChange* grown = calloc(new_cap, sizeof(IndexChange));
+        if (!grown) return NULL;
+        for (int i = 0; i < file_index.delta_cap; i++) {
+            IndexChange* c = &file_index.delta[i];
+            if (!c->path) continue;
+            uint32_t j = c->hash & (new_cap - 1);
+            while (grown[j].path) j = (j + 1) & (new_cap - 1);
+            grown[j] = *c;
+        }
+        free(file_index.delta);
+        file_index.delta = grown;
+        file_index.delta_cap = new_cap;
+    }
+    char* copy = strndup(path, len);
+    if (!copy) return NULL;
+    uint32_t mask = file_index.delta_cap - 1;
+    uint32_t i = h & mask;
+    while (file_index.delta[i].path) i = (i + 1) & mask;
+    file_index.delta[i] = (IndexChange){copy, h, 0, 0};
+    file_index.delta_count++;
+    return &file_index.delta[i];
+}
+
+// Whether rel, or a directory above it, was deleted after sequence since.
+// One lookup per path component.
+int index_hidden(const char* rel, long since) {
+    if (file_index.delta_count == 0) return 0;
+    for (size_t len = 0; ; len++) {
+        if (rel[len] == '/' || rel[len] == '\0') {
+            IndexChange* c = index_delta_find(rel, len, 0);
+            if (c && c->deleted > since) return 1;
+            if (rel[len] == '\0') return 0;
+        }
+    }
+}
+
+int index_in_scope(const char* rel, const char* scope) {
+    size_t len = strlen(scope);
+    return len == 0 || (strncmp(rel, scope, len) == 0 && rel[len] == '/');
+}
 
-        char full_path[1024];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+// Root as printed before "/rel"
+const char* index_root_prefix() {
+    return strcmp(file_index.root, "/") == 0 ? "" : file_index.root;
+}
 
-        if (entry->d_type == DT_DIR) {
-            delete_directory_contents(full_path);
-            rmdir(full_path);
-        } else {
-            unlink(full_path);
-        }
+int index_report(uint32_t i, const char* pattern, const char* scope, int check) {
+    const char* name = file_index.names + file_index.entries[i].name_off;
+    char rel[PATH_MAX];
+    if (check && fnmatch(pattern, name, 0) != 0) return 0;
+    if (index_entry_path(i, rel, sizeof(rel)) != 0 || !index_in_scope(rel, scope) || index_hidden(rel, 0)) {
+        return 0;
     }
-    closedir(dir);
+    printf("Found: %s/%s\n", index_root_prefix(), rel);
+    return 1;
 }
 
-void delete_directory(const char *path, int recursive) {
-    if (recursive) {
-        delete_directory_contents(path);
+int index_contains(const char* rel) {
+    const char* name = index_basename(rel);
+    char path[PATH_MAX];
+    for (uint32_t i = index_bound(name, 0); i < file_index.hdr->count; i++) {
+        if (strcmp(file_index.names + file_index.entries[i].name_off, name) != 0) break;
+        if (index_entry_path(i, path, sizeof(path)) == 0 && strcmp(path, rel) == 0) return 1;
     }
+    return 0;
+}
 
-    if (rmdir(path) == 0) {
-        printf("Directory '%s' deleted successfully.\n", path);
+// Print every indexed path under scope whose name matches the glob.
+// Exact names and literal prefixes use binary search, "*text*" scans the
+// name table with memmem, anything else tests every name.
+int index_query_locked(const char* pattern, const char* scope) {
+    int found = 0;
+    uint32_t count = file_index.hdr->count;
+    size_t literal = strcspn(pattern, "*?[\\");
+    size_t len = strlen(pattern);
+
+    if (literal == len) {
+        for (uint32_t i = index_bound(pattern, 0); i < count; i++) {
+            if (strcmp(file_index.names + file_index.entries[i].name_off, pattern) != 0) break;
+            found += index_report(i, pattern, scope, 0);
+        }
+    } else if (literal > 0) {
+        char prefix[PATH_MAX];
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)literal, pattern);
+        uint32_t end = index_bound(prefix, 1);
+        for (uint32_t i = index_bound(prefix, 0); i < end; i++) {
+            found += index_report(i, pattern, scope, 1);
+        }
+    } else if (len > 2 && pattern[len - 1] == '*' && strcspn(pattern + 1, "*?[\\") == len - 2) {
+        const char* names = file_index.names;
+        const char* end = names + file_index.hdr->names_size;
+        const char* at = names;
+        while ((at = memmem(at, end - at, pattern + 1, len - 2)) != NULL) {
+            // Entry owning this offset; name_off grows with the entry index
+            uint32_t lo = 0, hi = count;
+            while (hi - lo > 1) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (names + file_index.entries[mid].name_off <= at) lo = mid; else hi = mid;
+            }
+            found += index_report(lo, pattern, scope, 0);
+            at = names + file_index.entries[lo].name_off;
+            at += strlen(at) + 1;
+        }
     } else {
-        if (recursive) {
-            perror("Failed to delete directory (even with -r)");
-        } else {
-            printf("Directory not empty. Use -r to delete recursively.\n");
+        for (uint32_t i = 0; i < count; i++) found += index_report(i, pattern, scope, 1);
+    }
+
+    for (int i = 0; i < file_index.delta_cap; i++) {
+        const IndexChange* c = &file_index.delta[i];
+        const char* rel = c->path;
+        if (!rel || !c->added || index_hidden(rel, c->added)) continue;
+        // Skip paths the index already reported
+        if (fnmatch(pattern, index_basename(rel), 0) == 0 && index_in_scope(rel, scope) &&
+            !(index_contains(rel) && !index_hidden(rel, 0))) {
+            printf("Found: %s/%s\n", index_root_prefix(), rel);
+            found++;
         }
     }
+    return found;
 }
 
-void printTree(const char *base_path, int depth) {
-    DIR *dir;
-    struct dirent *entry;
+// Index lock held. A new directory's contents can be both found by the
+// walk and reported by events; the second report just renews the entry.
+int index_note_added(const char* rel) {
+    IndexChange* c = index_delta_find(rel, strlen(rel), 1);
+    if (!c) return -1;
+    c->added = ++file_index.delta_seq;
+    return 0;
+}
 
-    dir = opendir(base_path);
-    if (!dir) {
-        perror("opendir failed");
+// Index lock held. Hides rel and, through index_hidden, everything below it
+void index_note_deleted(const char* rel) {
+    IndexChange* c = index_delta_find(rel, strlen(rel), 1);
+    if (!c) {
+        file_index.rebuild = 1;
         return;
     }
+    c->deleted = ++file_index.delta_seq;
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+// Apply one inotify event. Runs on the watcher thread.
+void index_event(const struct inotify_event* ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        file_index.rebuild = 1;
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= file_index.watch_cap || !file_index.watch_paths[ev->wd]) return;
+    if (ev->mask & IN_IGNORED) {
+        free(file_index.watch_paths[ev->wd]);
+        file_index.watch_paths[ev->wd] = NULL;
+        file_index.watches--;
+        return;
+    }
+    if (ev->len == 0) return;
 
-        for (int i = 0; i < depth; i++)
-            printf("│   ");
-        printf("├── %s\n", entry->d_name);
+    const char* dir = file_index.watch_paths[ev->wd];
+    char rel[PATH_MAX];
+    if (snprintf(rel, sizeof(rel), "%s%s%s", dir, dir[0] ? "/" : "", ev->name) >= (int)sizeof(rel)) return;
 
-        char path[1024];
-        snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        pthread_mutex_lock(&file_index.lock);
+        index_note_deleted(rel);
+        file_index.changes++;
+        pthread_mutex_unlock(&file_index.lock);
+    }
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        // A new directory may already have contents (mkdir -p, mv)
+        IndexBuild b = {0};
+        b.root_len = strlen(file_index.root);
+        b.watch = 1;
+        char path[PATH_MAX];
+        if ((ev->mask & IN_ISDIR) &&
+            snprintf(path, sizeof(path), "%s/%s", file_index.root, rel) < (int)sizeof(path)) {
+            index_watch(path, rel);
+            index_collect(&b, path);
+        }
 
-        struct stat st;
-        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
-            printTree(path, depth + 1);
+        pthread_mutex_lock(&file_index.lock);
+        int failed = index_note_added(rel);
+        for (long i = 0; i < b.count && !failed; i++) {
+            failed = index_note_added(b.paths[i]);
         }
+        if (failed) file_index.rebuild = 1;
+        file_index.changes += 1 + b.count;
+        pthread_mutex_unlock(&file_index.lock);
+        index_free_paths(&b);
     }
-    closedir(dir);
+    if (file_index.changes > INDEX_DELTA_MAX) file_index.rebuild = 1;
 }
 
-void renameItem(const char *oldName, const char *newName) {
-    if (rename(oldName, newName) == 0) {
-        printf("Renamed '%s' to '%s'\n", oldName, newName);
-    } else {
-        perror("rename failed");
+// Walk root (adding watches), write the index file and load it.
+// Changes queued by inotify meanwhile are applied after the swap.
+int index_build(const char* root) {
+    char file[PATH_MAX];
+    index_path_file(file, sizeof(file));
+    IndexBuild b = {0};
+    b.root_len = strlen(root);
+    b.watch = 1;
+    index_watch(root, "");
+    if (index_collect(&b, root) != 0 || index_write(file, root, b.paths, b.count) != 0) {
+        index_free_paths(&b);
+        return -1;
     }
+    index_free_paths(&b);
+
+    pthread_mutex_lock(&file_index.lock);
+    int rc = index_load_locked(file);
+    index_clear_delta();
+    file_index.rebuild = 0;
+    pthread_mutex_unlock(&file_index.lock);
+    return rc;
 }
 
-void moveItem(const char *item, const char *newPath) {
-    const char *filename = strrchr(item, '/');
-    filename = (filename == NULL) ? item : filename + 1;
-
-    char fullDestPath[1024];
-    snprintf(fullDestPath, sizeof(fullDestPath), "%s/%s", newPath, filename);
+void* index_watcher(void* arg) {
+    (void)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (file_index.running) {
+        if (file_index.rebuild) {
+            char root[PATH_MAX];
+            pthread_mutex_lock(&file_index.lock);
+            strcpy(root, file_index.root);
+            pthread_mutex_unlock(&file_index.lock);
+            if (index_build(root) != 0) file_index.rebuild = 0;  // Keep serving the old one
+            continue;
+        }
 
-    if (rename(item, fullDestPath) == 0) {
-        printf("Moved '%s' to '%s'\n", item, fullDestPath);
-    } else {
-        perror("move failed");
+        struct pollfd pfd = {file_index.inotify_fd, POLLIN, 0};
+        if (poll(&pfd, 1, INDEX_POLL) <= 0) continue;
+        ssize_t n = read(file_index.inotify_fd, buf, sizeof(buf));
+        for (ssize_t off = 0; off < n; ) {
+            const struct inotify_event* ev = (const struct inotify_event*)(buf + off);
+            index_event(ev);
+            off += sizeof(struct inotify_event) + ev->len;
+        }
     }
+    return NULL;
 }
 
-const char *get_basename(const char *path) {
-    const char *last_slash = strrchr(path, '/');
-    return last_slash ? last_slash + 1 : path;
+void index_stop() {
+    if (file_index.running) {
+        file_index.running = 0;
+        file_index.stopping = 1;
+        pthread_join(file_index.thread, NULL);
+        file_index.stopping = 0;
+    }
+    if (file_index.inotify_fd >= 0) close(file_index.inotify_fd);
+    file_index.inotify_fd = -1;
+    for (int i = 0; i < file_index.watch_cap; i++) free(file_index.watch_paths[i]);
+    free(file_index.watch_paths);
+    file_index.watch_paths = NULL;
+    file_index.watch_cap = 0;
+    file_index.watches = 0;
+    file_index.watch_full = 0;
 }
 
-void auto_copy(const char *path) {
-    struct stat st;
-    if (stat(path, &st) != 0) {
-        perror("Error checking path");
+// Start watching the loaded index's tree. With rebuild, the watcher first
+// rewalks it, which also catches changes made while the shell was not running.
+void index_start(int rebuild) {
+    file_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (file_index.inotify_fd < 0) {
+        perror("inotify_init1");
         return;
     }
-
-    char newname[256];
-    char command[512];
-    int counter = 1;
-
-    const char *base = get_basename(path);
-    const char *dot = strrchr(base, '.');
-
-    do {
-        if (dot && S_ISREG(st.st_mode)) {
-            snprintf(newname, sizeof(newname), "%.*s(%d)%s",
-                    (int)(dot - base), base, counter, dot);
-        } else {
-            snprintf(newname, sizeof(newname), "%s(%d)", base, counter);
-        }
-        counter++;
-    } while (access(newname, F_OK) == 0);
-
-    if (S_ISDIR(st.st_mode)) {
-        snprintf(command, sizeof(command), "cp -r \"%s\" \"%s\"", path, newname);
-    } else {
-        snprintf(command, sizeof(command), "cp \"%s\" \"%s\"", path, newname);
+    file_index.rebuild = rebuild;
+    file_index.running = 1;
+    if (pthread_create(&file_index.thread, NULL, index_watcher, NULL) != 0) {
+        file_index.running = 0;
     }
+}
 
-    system(command);
-    printf("Created copy: %s\n", newname);
+void index_shutdown() {
+    index_stop();
+    pthread_mutex_lock(&file_index.lock);
+    index_clear_delta();
+    free(file_index.delta);
+    file_index.delta = NULL;
+    file_index.delta_cap = 0;
+    if (file_index.map) munmap(file_index.map, file_index.map_size);
+    file_index.map = NULL;
+    file_index.hdr = NULL;
+    pthread_mutex_unlock(&file_index.lock);
 }
 
-int search_file(const char *dir_path, const char *target_file, int *found) {
-    DIR *dir = opendir(dir_path);
-    if (!dir) {
-        if (errno != EACCES) {
-            perror("Failed to open directory");
-        }
-        return 0;
+// search --index <dir>
+void index_create(const char* dir) {
+    char root[PATH_MAX];
+    if (!realpath(dir, root)) {
+        perror("search --index");
+        return;
+    }
+    index_shutdown();
+    long start = get_time();
+    file_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (file_index.inotify_fd < 0) perror("inotify_init1 (index will not update)");
+    if (index_build(root) != 0) {
+        perror("search --index");
+        index_stop();
+        return;
+    }
+    printf("Indexed %u entries under %s in %ld ms\n", file_index.hdr->count, root, (get_time() - start) / 1000);
+    if (file_index.watch_full) {
+        printf("Warning: out of inotify watches, some directories will not update\n");
     }
 
-    struct dirent *entry;
-    char path[PATH_MAX];
-    int count = 0;
-
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+    int fd = file_index.inotify_fd;
+    if (fd >= 0) {
+        file_index.running = 1;
+        if (pthread_create(&file_index.thread, NULL, index_watcher, NULL) != 0) file_index.running = 0;
+    }
+}
 
-        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+// Load the saved index the first time search needs it
+void index_open() {
+    static int tried = 0;
+    if (file_index.map || tried) return;
+    tried = 1;
+    char file[PATH_MAX];
+    index_path_file(file, sizeof(file));
+    pthread_mutex_lock(&file_index.lock);
+    int rc = index_load_locked(file);
+    struct stat st;
+    if (rc == 0 && (stat(file_index.root, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        // The indexed tree is gone
+        munmap(file_index.map, file_index.map_size);
+        file_index.map = NULL;
+        file_index.hdr = NULL;
+        rc = -1;
+    }
+    pthread_mutex_unlock(&file_index.lock);
+    if (rc == 0) index_start(1);
+}
 
-        if (strcmp(entry->d_name, target_file) == 0) {
-            printf("Found: %s\n", path);
-            (*found)++;
-            count++;
+void print_index_status() {
+    index_open();
+    pthread_mutex_lock(&file_index.lock);
+    if (!file_index.map) {
+        printf("No index. Build one with: search --index <dir>\n");
+    } else {
+        time_t built = file_index.hdr->built;
+        printf("Index of %s: %u entries, %zu KB, built %s", file_index.root, file_index.hdr->count,
+               file_index.map_size / 1024, ctime(&built));
+        int added = 0, deleted = 0;
+        for (int i = 0; i < file_index.delta_cap; i++) {
+            const IndexChange* c = &file_index.delta[i];
+            if (!c->path) continue;
+            if (c->added > c->deleted) added++; else deleted++;
         }
+        printf("  Pending changes: %d added, %d deleted; %ld directories watched%s\n",
+               added, deleted, file_index.watches,
+               file_index.watch_full ? " (out of inotify watches)" : "");
+    }
+    pthread_mutex_unlock(&file_index.lock);
+}
 
-        if (entry->d_type == DT_DIR) {
-            count += search_file(path, target_file, found);
-        }
+// Answer search from the index if it covers cwd. Returns matches, or -1.
+int index_search(const char* cwd, const char* pattern) {
+    index_open();
+    pthread_mutex_lock(&file_index.lock);
+    int found = -1;
+    size_t len = strlen(file_index.root);
+    if (file_index.map && strncmp(cwd, file_index.root, len) == 0 &&
+        (cwd[len] == '\0' || cwd[len] == '/' || len == 1)) {
+        const char* scope = cwd + len;
+        while (*scope == '/') scope++;
+        found = index_query_locked(pattern, scope);
     }
-    closedir(dir);
-    return count;
+    pthread_mutex_unlock(&file_index.lock);
+    return found;
 }
 
 // Process Management Functions
 void print_processes(int detailed, int sort_id) {
     printf("\n=== Process Table ===\n");
     if (detailed) {
-        printf("%-6s %-15s %-10s %-3s %-8s %-8s %-4s %-4s %-8s\n",
-               "PID", "Command", "State", "PRI", "CPU(ms)", "Wait(ms)", "I/O", "AGE", "Mem(KB)");
-        printf("-----------------------------------------------------------------------\n");
+        printf("%-6s %-15s %-10s %-3s %-3s %-8s %-8s %-4s %-4s %-8s %-8s %-8s %-8s %-5s %-6s %-5s %-4s\n",
+               "PID", "Command", "State", "CPU", "PRI", "CPU(ms)", "Wait(ms)", "I/O", "AGE", "Mem(KB)",
+               "Real(ms)", "Wall(ms)", "RSS(KB)", "CSW", "Faults", "Hit%", "Frm");
+        printf("----------------------------------------------------------------------------------------------------------------------------\n");
     } else {
         printf("%-6s %-15s %-10s %-3s\n", "PID", "Command", "State", "PRI");
         printf("-----------------------------------\n");
     }
 
-    PCB* procs[MAX_PROCESSES];
+    int max = pcb_pool.capacity;
+    PCB** procs = malloc(max * sizeof(PCB*));
     int count = 0;
-
-    if (sched.running) procs[count++] = sched.running;
-
-    pthread_mutex_lock(&sched.ready.lock);
-    PCB* curr = sched.ready.head;
-    while (curr && count < MAX_PROCESSES) {
-        procs[count++] = curr;
-        curr = curr->next;
+    if (!procs) {
+        perror("procs");
+        return;
     }
-    pthread_mutex_unlock(&sched.ready.lock);
 
-    pthread_mutex_lock(&sched.waiting.lock);
-    curr = sched.waiting.head;
-    while (curr && count < MAX_PROCESSES) {
-        procs[count++] = curr;
-        curr = curr->next;
+    for (int c = 0; c < sched.num_cpus; c++) {
+        CPU* cpu = &sched.cpus[c];
+        pthread_mutex_lock(&cpu->lock);
+        if (cpu->running && count < max) procs[count++] = cpu->running;
+        count += sched_policy->collect(cpu, procs + count, max - count);
+        for (int i = 0; i < cpu->waiting.count && count < max; i++) {
+            procs[count++] = cpu->waiting.items[i];
+        }
+        pthread_mutex_unlock(&cpu->lock);
     }
-    pthread_mutex_unlock(&sched.waiting.lock);
 
     if (sort_id) {
         for (int i = 0; i < count-1; i++) {
@@ -704,9 +4942,12 @@ void print_processes(int detailed, int sort_id) {
         }
     }
 
+    long now = get_time();
     for (int i = 0; i < count; i++) {
         PCB* p = procs[i];
         const char* state_str;
+        // Aging cycles spent in the current ready level
+        int age = (p->state == PROC_READY) ? (int)((now - p->ready_since) / AGING_TICK) : 0;
 
         switch (p->state) {
             case PROC_NEW: state_str = "NEW"; break;
@@ -718,10 +4959,16 @@ void print_processes(int detailed, int sort_id) {
         }
         
         if (detailed) {
-            printf("%-6d %-15s %-10s %-3d %-8d %-8d %-4d %-4d %-8d\n",
-                   p->pid, p->command, state_str, p->priority,
+            sample_proc_usage(p);
+            process_info_t *mem = &vmm.processes[p->vmm_slot];
+            long hit_pct = mem->accesses ? (mem->accesses - mem->faults) * 100 / mem->accesses : 0;
+            printf("%-6d %-15s %-10s %-3d %-3d %-8d %-8d %-4d %-4d %-8d %-8ld %-8ld %-8ld %-5ld %-6ld %-5ld %-4d\n",
+                   p->pid, p->command, state_str, p->cpu, p->priority,
                    p->cpu_time/1000, p->wait_time/1000, 
-                   p->io_count, p->age_counter, p->memory_allocated/1024);
+                   p->io_count, age, p->memory_allocated/1024,
+                   p->real_cpu_us/1000, (now - p->arrival_time)/1000,
+                   p->max_rss_kb, p->ctx_switches,
+                   mem->faults, hit_pct, mem->resident);
         } else {
             printf("%-6d %-15s %-10s %-3d\n", p->pid, p->command, state_str, p->priority);
         }
@@ -734,53 +4981,109 @@ void print_processes(int detailed, int sort_id) {
                sched.total_wait/sched.done_procs/1000);
     }
     printf("===================\n\n");
+    free(procs);
 }
 
 void set_priority(int pid, int new_pri) {
-    if (new_pri < 0 || new_pri > 2) {
+    if (new_pri < 0 || new_pri > PRIORITY_LEVELS - 1) {
         printf("Priority must be 0 (HIGH), 1 (NORMAL), or 2 (LOW)\n");
         return;
     }
     
-    if (sched.running && sched.running->pid == pid) {
-        sched.running->priority = new_pri;
-        printf("Set running PID %d priority to %d\n", pid, new_pri);
+    PCB* curr = pid_table_lookup(&sched.pids, pid);
+    if (!curr) {
+        printf("Process PID %d not found\n", pid);
         return;
     }
-    
-    pthread_mutex_lock(&sched.ready.lock);
-    PCB* curr = sched.ready.head;
-    while (curr) {
-        if (curr->pid == pid) {
-            curr->priority = new_pri;
-            curr->age_counter = 0;
-            printf("Set PID %d priority to %d\n", pid, new_pri);
-            pthread_mutex_unlock(&sched.ready.lock);
-            return;
-        }
-        curr = curr->next;
+
+    CPU* cpu = lock_pcb_cpu(curr);
+    if (curr->state == PROC_READY) {
+        // Requeue under the new priority (tail of its level for rr/mlfq)
+        sched_dequeue_locked(cpu, curr);
+        curr->priority = new_pri;
+        sched_enqueue_locked(cpu, curr, ENQ_MOVE);
+        printf("Set PID %d priority to %d\n", pid, new_pri);
+    } else {
+        curr->priority = new_pri;
+        printf("Set %s PID %d priority to %d\n",
+               curr->state == PROC_RUNNING ? "running" : "waiting", pid, new_pri);
     }
-    pthread_mutex_unlock(&sched.ready.lock);
-    
-    pthread_mutex_lock(&sched.waiting.lock);
-    curr = sched.waiting.head;
-    while (curr) {
-        if (curr->pid == pid) {
-            curr->priority = new_pri;
-            printf("Set waiting PID %d priority to %d\n", pid, new_pri);
-            pthread_mutex_unlock(&sched.waiting.lock);
-            return;
+    apply_enforcement(curr);
+    pthread_mutex_unlock(&cpu->lock);
+}
+
+// Switch enforcement modes with every CPU locked (ascending id), releasing
+// the old mode's effects on each live child before applying the new one
+void set_enforcement(EnforceMode mode) {
+    if (mode == ENFORCE_NICE) {
+        // Let children inherit the right to get back to nice 0 after aging
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NICE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NICE, &rl);
         }
-        curr = curr->next;
     }
-    pthread_mutex_unlock(&sched.waiting.lock);
-    
-    printf("Process PID %d not found\n", pid);
+
+    for (int i = 0; i < sched.num_cpus; i++) {
+        pthread_mutex_lock(&sched.cpus[i].lock);
+    }
+    for (int i = 0; i < sched.pids.capacity; i++) {
+        if (sched.pids.slots[i]) release_enforcement(sched.pids.slots[i]);
+    }
+    enforce_mode = mode;
+    for (int i = 0; i < sched.pids.capacity; i++) {
+        if (sched.pids.slots[i]) apply_enforcement(sched.pids.slots[i]);
+    }
+    for (int i = sched.num_cpus - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&sched.cpus[i].lock);
+    }
+    printf("Scheduler enforcement: %s\n", enforce_names[mode]);
+}
+
+// Switch policies with every CPU locked (ascending id): drain each CPU's
+// ready set through the old policy and hand it to the new one as arrivals.
+// Running and waiting PCBs meet the new policy at their next transition.
+void set_policy(const SchedPolicy* policy) {
+    PCB** drained = malloc(pcb_pool.capacity * sizeof(PCB*));
+    if (!drained) {
+        perror("sched policy");
+        return;
+    }
+
+    for (int i = 0; i < sched.num_cpus; i++) {
+        pthread_mutex_lock(&sched.cpus[i].lock);
+    }
+    for (int i = 0; i < sched.num_cpus; i++) {
+        CPU* cpu = &sched.cpus[i];
+        int n = 0;
+        PCB* p;
+        while ((p = sched_pick_next_locked(cpu))) drained[n++] = p;
+
+        const SchedPolicy* old = sched_policy;
+        sched_policy = policy;
+        cpu->next_boost = 0;
+        for (int j = 0; j < n; j++) sched_enqueue_locked(cpu, drained[j], ENQ_NEW);
+        sched_policy = old;
+    }
+    sched_policy = policy;
+    sched.num_samples = 0;  // Latency percentiles are per policy
+    for (int i = sched.num_cpus - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&sched.cpus[i].lock);
+        scheduler_wake(&sched.cpus[i]);
+    }
+    free(drained);
+    printf("Scheduler policy: %s (%s)\n", policy->name, policy->description);
+}
+
+int compare_long(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
 }
 
 void print_scheduler_stats() {
     printf("\n=== Scheduler Statistics ===\n");
-    printf("Algorithm: Round Robin + Priority + Aging\n");
+    printf("Algorithm: %s (policy %s)\n", sched_policy->description, sched_policy->name);
+    printf("Enforcement: %s\n", enforce_names[enforce_mode]);
     printf("Time Slice: %d ms\n", TIME_SLICE/1000);
     printf("Aging: Priority boost every %d cycles\n", AGING_BOOST);
     printf("I/O Time: %d ms simulation\n", IO_TIME/1000);
@@ -788,14 +5091,28 @@ void print_scheduler_stats() {
     printf("  Total Created: %d\n", sched.total_procs);
     printf("  Completed: %d\n", sched.done_procs);
     printf("  Active: %d\n", sched.total_procs - sched.done_procs);
-    printf("  Ready Queue: %d\n", sched.ready.count);
-    printf("  I/O Waiting: %d\n", sched.waiting.count);
+    int ready = 0, waiting = 0;
+    for (int i = 0; i < sched.num_cpus; i++) {
+        ready += sched.cpus[i].nr_ready;
+        waiting += sched.cpus[i].waiting.count;
+    }
+    printf("  Ready Queue: %d\n", ready);
+    printf("  I/O Waiting: %d\n", waiting);
+    printf("  PCB Pool: %d/%d in use\n", pcb_pool.in_use, pcb_pool.capacity);
+    printf("  Thrashing suspensions: %ld\n", vmm.thrash_suspends);
     
-    if (sched.running) {
-        printf("  Currently Running: PID %d (%s)\n", 
-               sched.running->pid, sched.running->command);
-    } else {
-        printf("  Currently Running: None\n");
+    printf("\nCPUs: %d\n", sched.num_cpus);
+    for (int i = 0; i < sched.num_cpus; i++) {
+        CPU* cpu = &sched.cpus[i];
+        pthread_mutex_lock(&cpu->lock);
+        if (cpu->running) {
+            printf("  CPU %d: PID %-6d (%s)", i, cpu->running->pid, cpu->running->command);
+        } else {
+            printf("  CPU %d: idle", i);
+        }
+        printf(" - ready %d, I/O %d, dispatches %d, steals %d\n",
+               cpu->nr_ready, cpu->waiting.count, cpu->dispatches, cpu->steals);
+        pthread_mutex_unlock(&cpu->lock);
     }
     
     if (sched.done_procs > 0) {
@@ -805,23 +5122,95 @@ void print_scheduler_stats() {
         printf("  Average Wait Time: %ld ms\n", 
                sched.total_wait/sched.done_procs/1000);
     }
+    if (sched.num_samples > 0) {
+        int n = sched.num_samples < TURNAROUND_SAMPLES ? sched.num_samples : TURNAROUND_SAMPLES;
+        long sorted[TURNAROUND_SAMPLES];
+        memcpy(sorted, sched.turnaround_samples, n * sizeof(long));
+        qsort(sorted, n, sizeof(long), compare_long);
+        printf("  Turnaround p50/p95/p99: %ld/%ld/%ld ms (last %d under %s)\n",
+               sorted[n / 2]/1000, sorted[n * 95 / 100]/1000, sorted[n * 99 / 100]/1000,
+               n, sched_policy->name);
+    }
+    if (sched.done_procs > 0) {
+
+        printf("\nReal Usage (completed, from wait4):\n");
+        printf("  Total CPU: %ld ms (avg %ld ms)\n",
+               sched.total_real_cpu/1000, sched.total_real_cpu/sched.done_procs/1000);
+        printf("  Average Wall Time: %ld ms\n",
+               sched.total_turnaround/sched.done_procs/1000);
+        printf("  Peak Max RSS: %ld KB\n", sched.peak_rss_kb);
+        printf("  Context Switches: %ld\n", sched.total_ctx_switches);
+    }
     printf("===========================\n\n");
 }
 
 void print_vmm_status() {
     printf("\n=== VMM Status ===\n");
-    
-    int used_frames = 0;
-    for (int i = 0; i < PHYSICAL_FRAMES; i++) {
-        if (vmm.frames[i].is_used) used_frames++;
+    pthread_mutex_lock(&vmm.lock);
+
+    if (vmm.num_frames <= FRAME_TABLE_MAX) {
+        printf("Frame Table:\n");
+        for (int i = 0; i < vmm.num_frames; i++) {
+            if (vmm.frames[i].is_used) {
+                printf("  Frame %d: PID=%d, Page=%d, Time=%d\n", 
+                       i, vmm.frames[i].process_id, 
+                       vmm.frames[i].page_number, vmm.frames[i].load_time);
+            } else {
+                printf("  Frame %d: FREE\n", i);
+            }
+        }
     }
+
+    int used_frames = vmm.num_frames - bitmap_count(vmm.free_frames, vmm.num_frames);
+    int used_swap = vmm.swap_slots - vmm.swap_free;
     
-    printf("Physical Memory: %d/%d frames used (%d%%)\n", 
-           used_frames, PHYSICAL_FRAMES, (used_frames * 100) / PHYSICAL_FRAMES);
+    printf("Geometry: %d KB pages, %d virtual pages/process, %d process slots\n",
+           vmm.page_size / 1024, vmm.virtual_pages, vmm.max_processes);
+    printf("Physical Memory: %d/%d frames used (%ld%%)\n", 
+           used_frames, vmm.num_frames, (used_frames * 100L) / vmm.num_frames);
     printf("Active VMM Processes: %d\n", vmm.num_processes);
-    printf("Memory Utilization: %d KB / %d KB\n", 
-           (used_frames * PAGE_SIZE) / 1024, 
-           (PHYSICAL_FRAMES * PAGE_SIZE) / 1024);
+    printf("Memory Utilization: %ld KB / %ld KB\n", 
+           ((long)used_frames * vmm.page_size) / 1024, 
+           ((long)vmm.num_frames * vmm.page_size) / 1024);
+    printf("Swap slots used: %d/%d\n", used_swap, vmm.swap_slots);
+    printf("TLB: %d sets x %d ways, %ld hits, %ld misses (hit rate %ld%%), "
+           "%ld shootdowns, %ld flushes\n", TLB_SETS, TLB_WAYS, vmm.tlb_hits, vmm.tlb_misses,
+           vmm.tlb_hits + vmm.tlb_misses ? vmm.tlb_hits * 100 / (vmm.tlb_hits + vmm.tlb_misses) : 0,
+           vmm.tlb_shootdowns, vmm.tlb_flushes);
+    printf("Page tables: %d levels, %ld nodes (%ld KB)\n", vmm.pt_levels, vmm.pt_nodes,
+           vmm.pt_nodes * (long)sizeof(PageTableNode) / 1024);
+    printf("Accesses: %ld, Faults: %ld (hit rate %ld%%, %ld failed on swap reads)\n",
+           vmm.total_accesses, vmm.total_faults,
+           vmm.total_accesses ? (vmm.total_accesses - vmm.total_faults) * 100 / vmm.total_accesses : 0,
+           vmm.failed_faults);
+    printf("Replacement: %s, Evictions: %ld, Swap writes: %ld, Dirty pages dropped: %ld\n",
+           repl_policy->name, vmm.evictions, vmm.swap_writes, vmm.swap_drops);
+    if (vmm.pff) {
+        printf("Frame allocation: pff, %ld/%d frames allotted, %ld thrashing suspensions\n",
+               vmm.total_quota, vmm.num_frames, vmm.thrash_suspends);
+        for (int i = 0; i < vmm.max_processes; i++) {
+            process_info_t *proc = &vmm.processes[i];
+            if (proc->pid == -1) continue;
+            printf("  PID %-6d resident %d/%d quota, last fault rate %d%%%s\n", proc->pid,
+                   proc->resident, proc->quota, proc->fault_rate, proc->thrashing ? ", thrashing" : "");
+        }
+    } else {
+        printf("Frame allocation: global\n");
+    }
+    pthread_mutex_lock(&swap_device.lock);
+    printf("Swap I/O: %ld reads (avg stall %ld us, %ld from pending writes), "
+           "%ld writes (avg %ld us), %d in flight, %ld errors\n",
+           swap_device.reads, swap_device.reads ? swap_device.read_wait_us / swap_device.reads : 0,
+           swap_device.cached_reads, swap_device.writes,
+           swap_device.writes ? swap_device.write_us / swap_device.writes : 0,
+           swap_device.writes_in_flight, swap_device.errors);
+    pthread_mutex_unlock(&swap_device.lock);
+    if (repl_policy->reset == arc_reset) {
+        printf("ARC: T1=%d T2=%d B1=%d B2=%d p=%d\n", vmm.arc_t1.count, vmm.arc_t2.count,
+               vmm.arc_b1.count, vmm.arc_b2.count, vmm.arc_p);
+    }
+    printf("Next frame time: %d\n", vmm.next_frame_time);
+    pthread_mutex_unlock(&vmm.lock);
     printf("==================\n\n");
 }
 
@@ -833,6 +5222,9 @@ void restore_terminal() {
 void handle_sigint(int sig) {
     if (foreground_pgid > 0) {
         kill(-foreground_pgid, SIGINT);
+        if (enforce_mode == ENFORCE_STOP) {
+            kill(-foreground_pgid, SIGCONT);  // A held child must see the SIGINT
+        }
     }
     ctrl_x_pressed = 1;
     restore_terminal();
@@ -896,17 +5288,33 @@ void print_help() {
     printf("  priority <pid> <0-2> - Set process priority (0=HIGH, 1=NORMAL, 2=LOW)\n");
     printf("  stats         - Show scheduler statistics\n");
     printf("  vmm           - Toggle VMM verbose output (currently: %s)\n", vmm_verbose ? "ON" : "OFF");
+    printf("  vmm status    - Show frames, swap and page-fault counters\n");
+    printf("  vmm policy [fifo|second|clock|lru|arc] - Show or switch page replacement (currently: %s)\n",
+           repl_policy->name);
+    printf("  vmm resize <frames> - Grow or shrink physical memory (currently: %d frames)\n", vmm.num_frames);
+    printf("  vmm alloc [global|pff] - Show or switch frame allocation (currently: %s)\n",
+           vmm.pff ? "pff" : "global");
+    printf("  vmm replay <trace> - Run a binary access trace through the VMM\n");
+    printf("  vmm convert <input> <trace> - Build a binary trace from text or valgrind lackey output\n");
     printf("  sched         - Toggle scheduler verbose output (currently: %s)\n", scheduler_verbose ? "ON" : "OFF");
+    printf("  sched enforce <off|stop|nice> - Apply scheduling to real children (currently: %s)\n",
+           enforce_names[enforce_mode]);
+    printf("  sched policy [rr|mlfq|cfs|sjf] - Show or switch scheduling policy (currently: %s)\n",
+           sched_policy->name);
     
     printf("\nFILE OPERATIONS:\n");
-    printf("  create [-f] <file> - Create file (use -f for random size)\n");
+    printf("  create [-f | -s size] [-z | -a | -p pattern] <file> - Create file (-f random size,\n");
+    printf("                -s size e.g. 4G; random data unless -z sparse, -a fallocate, -p pattern)\n");
     printf("  modify <file>      - Modify file by appending content\n");
     printf("  delete <file>      - Delete file\n");
     printf("  finf [-d] <file>   - Get file information (use -d for details)\n");
     printf("  copy <target>      - Copy file/directory with auto-numbering\n");
     printf("  rename <old> <new> - Rename file or directory\n");
     printf("  move <src> <dest>  - Move file/directory\n");
-    printf("  search <file>      - Search for file in directory tree\n");
+    printf("  search <file>      - Search for file in directory tree (*?[] globs)\n");
+    printf("  search [file] [-r regex] [-size [+-]N[KMG]] [-mtime [+-]N[smhd]] [--content text]\n");
+    printf("                     - Filter by name regex, size, age; --content greps file bodies\n");
+    printf("  search --index [dir] - Index dir for instant searches below it (no dir: status)\n");
     
     printf("\nDIRECTORY OPERATIONS:\n");
     printf("  newdir <dir>       - Create new directory\n");
@@ -921,7 +5329,7 @@ void print_help() {
     printf("  command &     - Run command in background\n\n");
     
     printf("SCHEDULER INFO:\n");
-    printf("  Algorithm: Round Robin + Priority + Aging\n");
+    printf("  Algorithm: %s\n", sched_policy->description);
     printf("  Time Slice: %dms, Aging: every %d cycles\n", TIME_SLICE/1000, AGING_BOOST);
     printf("  Priority Levels: 0=HIGH, 1=NORMAL, 2=LOW\n");
     printf("================================\n\n");
@@ -931,57 +5339,10 @@ void check_background_processes() {
     int status;
     pid_t pid;
     
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        int found = 0;
-        
-        if (sched.running && sched.running->pid == pid) {
-            finish_process(sched.running);
-            found = 1;
-        } else {
-            pthread_mutex_lock(&sched.ready.lock);
-            PCB* curr = sched.ready.head;
-            PCB* prev = NULL;
-            
-            while (curr && !found) {
-                if (curr->pid == pid) {
-                    if (prev) {
-                        prev->next = curr->next;
-                    } else {
-                        sched.ready.head = curr->next;
-                    }
-                    sched.ready.count--;
-                    finish_process(curr);
-                    found = 1;
-                } else {
-                    prev = curr;
-                    curr = curr->next;
-                }
-            }
-            pthread_mutex_unlock(&sched.ready.lock);
-            
-            if (!found) {
-                pthread_mutex_lock(&sched.waiting.lock);
-                curr = sched.waiting.head;
-                prev = NULL;
-                
-                while (curr) {
-                    if (curr->pid == pid) {
-                        if (prev) {
-                            prev->next = curr->next;
-                        } else {
-                            sched.waiting.head = curr->next;
-                        }
-                        sched.waiting.count--;
-                        finish_process(curr);
-                        found = 1;
-                        break;
-                    }
-                    prev = curr;
-                    curr = curr->next;
-                }
-                pthread_mutex_unlock(&sched.waiting.lock);
-            }
-        }
+    struct rusage usage;
+    
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        int found = reap_process(pid, &usage);
         
         if (found) {
             printf("[Background process %d completed]\n", pid);
@@ -1016,9 +5377,8 @@ void execute_commands(char **commands) {
             // Handle built-in commands
             if (strcmp(args[0], "quit") == 0) {
                 printf("Exiting shell...\n");
-                sched.scheduler_on = 0;
                 restore_terminal();
-                pthread_join(sched.sched_thread, NULL);
+                stop_scheduler();
                 exit(0);
             }
             else if (strcmp(args[0], "help") == 0) {
@@ -1077,6 +5437,51 @@ void execute_commands(char **commands) {
                 continue;
             }
             else if (strcmp(args[0], "vmm") == 0) {
+                if (args[1] && strcmp(args[1], "status") == 0) {
+                    print_vmm_status();
+                    continue;
+                }
+                if (args[1] && strcmp(args[1], "policy") == 0) {
+                    const ReplacementPolicy* policy = NULL;
+                    for (int i = 0; args[2] && i < NUM_REPL_POLICIES; i++) {
+                        if (strcmp(args[2], repl_policies[i].name) == 0) policy = &repl_policies[i];
+                    }
+                    if (policy) {
+                        set_replacement_policy(policy);
+                    } else {
+                        if (args[2]) printf("Unknown policy: %s\n", args[2]);
+                        for (int i = 0; i < NUM_REPL_POLICIES; i++) {
+                            printf("  %c %-6s %s\n", &repl_policies[i] == repl_policy ? '*' : ' ',
+                                   repl_policies[i].name, repl_policies[i].description);
+                        }
+                    }
+                    continue;
+                }
+                if (args[1] && strcmp(args[1], "alloc") == 0) {
+                    if (args[2] && strcmp(args[2], "pff") == 0) set_frame_allocation(1);
+                    else if (args[2] && strcmp(args[2], "global") == 0) set_frame_allocation(0);
+                    else printf("Frame allocation: %s (vmm alloc global|pff)\n", vmm.pff ? "pff" : "global");
+                    continue;
+                }
+                if (args[1] && strcmp(args[1], "replay") == 0) {
+                    if (args[2]) vmm_replay(args[2]);
+                    else printf("Usage: vmm replay <trace>\n");
+                    continue;
+                }
+                if (args[1] && strcmp(args[1], "convert") == 0) {
+                    if (args[2] && args[3]) trace_convert(args[2], args[3]);
+                    else printf("Usage: vmm convert <input> <trace>\n");
+                    continue;
+                }
+                if (args[1] && strcmp(args[1], "resize") == 0) {
+                    long long frames = args[2] ? parse_size(args[2]) : -1;
+                    if (frames < 1 || frames > PTE_MAX_FRAMES) {
+                        printf("Usage: vmm resize <frames>\n");
+                    } else if (vmm_resize((int)frames) != 0) {
+                        perror("vmm resize");
+                    }
+                    continue;
+                }
                 vmm_verbose = !vmm_verbose;
                 printf("VMM verbose output: %s\n", vmm_verbose ? "ON" : "OFF");
                 if (vmm_verbose) {
@@ -1085,6 +5490,34 @@ void execute_commands(char **commands) {
                 continue;
             }
             else if (strcmp(args[0], "sched") == 0) {
+                if (args[1] && strcmp(args[1], "enforce") == 0) {
+                    int mode = -1;
+                    for (int m = ENFORCE_OFF; args[2] && m <= ENFORCE_NICE; m++) {
+                        if (strcmp(args[2], enforce_names[m]) == 0) mode = m;
+                    }
+                    if (mode < 0) {
+                        printf("Usage: sched enforce <off|stop|nice>\n");
+                    } else {
+                        set_enforcement(mode);
+                    }
+                    continue;
+                }
+                if (args[1] && strcmp(args[1], "policy") == 0) {
+                    const SchedPolicy* policy = NULL;
+                    for (int i = 0; args[2] && i < NUM_POLICIES; i++) {
+                        if (strcmp(args[2], sched_policies[i].name) == 0) policy = &sched_policies[i];
+                    }
+                    if (policy) {
+                        set_policy(policy);
+                    } else {
+                        if (args[2]) printf("Unknown policy: %s\n", args[2]);
+                        for (int i = 0; i < NUM_POLICIES; i++) {
+                            printf("  %c %-5s %s\n", &sched_policies[i] == sched_policy ? '*' : ' ',
+                                   sched_policies[i].name, sched_policies[i].description);
+                        }
+                    }
+                    continue;
+                }
                 scheduler_verbose = !scheduler_verbose;
                 printf("Scheduler verbose output: %s\n", scheduler_verbose ? "ON" : "OFF");
                 continue;
@@ -1092,20 +5525,42 @@ void execute_commands(char **commands) {
             // File operations
             else if (strcmp(args[0], "create") == 0) {
                 if (args[1] == NULL) {
-                    printf("Usage: create [-f] <file1> [file2...]\n");
+                    printf("Usage: create [-f | -s size] [-z | -a | -p pattern] <file1> [file2...]\n");
                     continue;
                 }
 
                 int random_size = 0;
+                long long size = 1024;  // Default 1KB
+                FillMode mode = FILL_RANDOM;
+                const char* pattern = NULL;
                 int file_arg_start = 1;
-
-                if (strcmp(args[1], "-f") == 0) {
-                    if (args[2] == NULL) {
-                        printf("Error: -f requires filename\n");
-                        continue;
+                int bad = 0;
+
+                for (; args[file_arg_start] && args[file_arg_start][0] == '-'; file_arg_start++) {
+                    const char* opt = args[file_arg_start];
+                    const char* value = args[file_arg_start + 1];
+                    if (strcmp(opt, "-f") == 0) {
+                        random_size = 1;
+                    } else if (strcmp(opt, "-z") == 0) {
+                        mode = FILL_SPARSE;
+                    } else if (strcmp(opt, "-a") == 0) {
+                        mode = FILL_ALLOC;
+                    } else if (strcmp(opt, "-s") == 0 && value && (size = parse_size(value)) >= 0) {
+                        file_arg_start++;
+                    } else if (strcmp(opt, "-p") == 0 && value && value[0]) {
+                        mode = FILL_PATTERN;
+                        pattern = value;
+                        file_arg_start++;
+                    } else {
+                        printf("Error: bad option %s\n", opt);
+                        bad = 1;
+                        break;
                     }
-                    random_size = 1;
-                    file_arg_start = 2;
+                }
+                if (bad) continue;
+                if (args[file_arg_start] == NULL) {
+                    printf("Error: create requires filename\n");
+                    continue;
                 }
 
                 static int seeded = 0;
@@ -1115,7 +5570,9 @@ void execute_commands(char **commands) {
                 }
 
                 for (int j = file_arg_start; args[j] != NULL; j++) {
-                    create_file(args[j], random_size);
+                    // Random 1KB-10MB per file with -f
+                    long long file_size = random_size ? (rand() % (10 * 1024 * 1024 - 1024)) + 1024 : size;
+                    create_file(args[j], file_size, mode, pattern);
                 }
                 continue;
             }
@@ -1189,7 +5646,16 @@ void execute_commands(char **commands) {
             }
             else if (strcmp(args[0], "search") == 0) {
                 if (args[1] == NULL) {
-                    printf("Usage: search <filename>\n");
+                    printf("Usage: search [name or glob] [-r regex] [-size [+-]N[KMG]] [-mtime [+-]N[smhd]]\n"
+                           "              [--content text] | search --index [dir]\n");
+                    continue;
+                }
+                if (strcmp(args[1], "--index") == 0) {
+                    if (args[2]) {
+                        index_create(args[2]);
+                    } else {
+                        print_index_status();
+                    }
                     continue;
                 }
 
@@ -1199,13 +5665,69 @@ void execute_commands(char **commands) {
                     continue;
                 }
 
-                printf("Searching for '%s' in %s and subdirectories...\n", args[1], cwd);
+                SearchQuery q = {0};
+                int bad = 0;
+                for (int j = 1; args[j] != NULL && !bad; j++) {
+                    const char* value = args[j + 1];
+                    static const long size_scale[] = {1, 1024, 1024 * 1024, 1024 * 1024 * 1024};
+                    static const long age_scale[] = {86400, 1, 60, 3600, 86400};
+                    long long age;
+                    if (strcmp(args[j], "-r") == 0 && value && !q.use_regex) {
+                        int rc = regcomp(&q.regex, value, REG_EXTENDED | REG_NOSUB);
+                        if (rc != 0) {
+                            char msg[256];
+                            regerror(rc, &q.regex, msg, sizeof(msg));
+                            printf("search: bad regex '%s': %s\n", value, msg);
+                            bad = 1;
+                        } else {
+                            q.use_regex = 1;
+                        }
+                    } else if (strcmp(args[j], "-size") == 0 && value) {
+                        if (parse_predicate(value, &q.size_cmp, "KMG", size_scale, &q.size, NULL) != 0) {
+                            printf("search: bad size '%s'\n", value);
+                            bad = 1;
+                        }
+                        q.use_size = 1;
+                    } else if (strcmp(args[j], "-mtime") == 0 && value) {
+                        if (parse_predicate(value, &q.age_cmp, "smhd", age_scale, &age, &q.age_unit) != 0) {
+                            printf("search: bad age '%s'\n", value);
+                            bad = 1;
+                        }
+                        q.age = age;
+                        q.use_age = 1;
+                    } else if (strcmp(args[j], "--content") == 0 && value) {
+                        q.content = value;
+                        q.content_len = strlen(value);
+                    } else if (args[j][0] != '-' && !q.name) {
+                        q.name = args[j];
+                        q.glob = q.name[strcspn(q.name, "*?[\\")] != '\0';
+                        continue;
+                    } else {
+                        printf("search: bad argument %s\n", args[j]);
+                        bad = 1;
+                    }
+                    j++;
+                }
+                if (bad) {
+                    if (q.use_regex) regfree(&q.regex);
+                    continue;
+                }
+                q.now = time(NULL);
 
-                int found = 0;
-                search_file(cwd, args[1], &found);
+                // The index only knows names
+                int found = -1;
+                if (q.name && !q.use_regex && !q.use_size && !q.use_age && !q.content) {
+                    found = index_search(cwd, q.name);
+                }
+                if (found < 0) {
+                    printf("Searching for '%s' in %s and subdirectories...\n", q.name ? q.name : "*", cwd);
+                    found = 0;
+                    search_file(cwd, &q, &found);
+                }
+                if (q.use_regex) regfree(&q.regex);
 
                 if (found == 0) {
-                    printf("No matches found for '%s'\n", args[1]);
+                    printf("No matches found for '%s'\n", q.name ? q.name : "*");
                 } else {
                     printf("Found %d match(es)\n", found);
                 }
@@ -1276,11 +5798,12 @@ void execute_commands(char **commands) {
                 printf("Last modified: %s", ctime(&st.st_mtime));
 
                 if (detailed) {
-                    DIR *dir = opendir(target);
-                    int file_count = 0;
-                    int dir_count = 0;
-                    long total_size = 0;
-                    struct dirent *entry;
+                    DirCounts counts = {0};
+                    Walker w = {0};
+                    w.visit = dinf_visit;
+                    w.arg = &counts;
+                    w.max_depth = 1;
+                    w.errors_as = "Failed to open directory";
 
                     printf("\n-- Detailed Information --\n");
                     printf("Inode: %ld\n", st.st_ino);
@@ -1289,28 +5812,9 @@ void execute_commands(char **commands) {
                     printf("Group GID: %d\n", st.st_gid);
                     printf("Device: %ld\n", st.st_dev);
 
-                    if (dir) {
-                        while ((entry = readdir(dir)) != NULL) {
-                            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                                continue;
-
-                            char full_path[PATH_MAX];
-                            snprintf(full_path, sizeof(full_path), "%s/%s", target, entry->d_name);
-
-                            struct stat entry_st;
-                            if (stat(full_path, &entry_st) == 0) {
-                                if (S_ISDIR(entry_st.st_mode)) {
-                                    dir_count++;
-                                } else {
-                                    file_count++;
-                                    total_size += entry_st.st_size;
-                                }
-                            }
-                        }
-                        closedir(dir);
-
-                        printf("Contents: %d files, %d subdirectories\n", file_count, dir_count);
-                        printf("Total size of files: %ld bytes\n", total_size);
+                    if (walk_tree(&w, target, NULL) == 0 && w.dirs > 0) {
+                        printf("Contents: %ld files, %ld subdirectories\n", counts.files, counts.dirs);
+                        printf("Total size of files: %lld bytes\n", counts.bytes);
                     }
                     printf("Last access: %s", ctime(&st.st_atime));
                     printf("Last status change: %s", ctime(&st.st_ctime));
@@ -1322,9 +5826,9 @@ void execute_commands(char **commands) {
                 if (args[1] == NULL) {
                     char cwd[PATH_MAX];
                     getcwd(cwd, sizeof(cwd));
-                    printTree(cwd, 0);
+                    printTree(cwd);
                 } else {
-                    printTree(args[1], 0);
+                    printTree(args[1]);
                 }
                 continue;
             }
@@ -1344,7 +5848,8 @@ void execute_commands(char **commands) {
                 execvp(args[0], args);
                 fprintf(stderr, "Execution failed: %s\n", strerror(errno));
                 fflush(stderr);
-                exit(1);
+                // _exit: atexit cleanup belongs to the shell, not this copy of it
+                _exit(127);
             } else {
                 // Parent - create PCB and add to scheduler
                 int memory_size;
@@ -1371,7 +5876,7 @@ void execute_commands(char **commands) {
                 PCB* process = create_process(pids[i], args[0], memory_size);
                 if (process) {
                     process->state = PROC_READY;
-                    enqueue(&sched.ready, process);
+                    enqueue_ready(process);
                 }
                 
                 if (!is_background[i] && i == 0) {
@@ -1389,66 +5894,17 @@ void execute_commands(char **commands) {
     for (int i = 0; i < num_commands; i++) {
         if (commands[i] != NULL && !is_background[i]) {
             int status;
-            pid_t finished_pid = waitpid(pids[i], &status, 0);
+            struct rusage usage;
+            pid_t finished_pid = wait4(pids[i], &status, 0, &usage);
             
             if (finished_pid > 0) {
-                int found = 0;
-                
-                if (sched.running && sched.running->pid == finished_pid) {
-                    finish_process(sched.running);
-                    found = 1;
-                } else {
-                    pthread_mutex_lock(&sched.ready.lock);
-                    PCB* curr = sched.ready.head;
-                    PCB* prev = NULL;
-                    
-                    while (curr && !found) {
-                        if (curr->pid == finished_pid) {
-                            if (prev) {
-                                prev->next = curr->next;
-                            } else {
-                                sched.ready.head = curr->next;
-                            }
-                            sched.ready.count--;
-                            finish_process(curr);
-                            found = 1;
-                        } else {
-                            prev = curr;
-                            curr = curr->next;
-                        }
-                    }
-                    pthread_mutex_unlock(&sched.ready.lock);
-                    
-                    if (!found) {
-                        pthread_mutex_lock(&sched.waiting.lock);
-                        curr = sched.waiting.head;
-                        prev = NULL;
-                        
-                        while (curr) {
-                            if (curr->pid == finished_pid) {
-                                if (prev) {
-                                    prev->next = curr->next;
-                                } else {
-                                    sched.waiting.head = curr->next;
-                                }
-                                sched.waiting.count--;
-                                finish_process(curr);
-                                found = 1;
-                                break;
-                            }
-                            prev = curr;
-                            curr = curr->next;
-                        }
-                        pthread_mutex_unlock(&sched.waiting.lock);
-                    }
-                }
+                reap_process(finished_pid, &usage);
             }
             
             if (ctrl_x_pressed) {
                 printf("\nExiting shell...\n");
-                sched.scheduler_on = 0;
                 restore_terminal();
-                pthread_join(sched.sched_thread, NULL);
+                stop_scheduler();
                 exit(0);
             }
         }
@@ -1510,8 +5966,7 @@ void process_batch_file(const char *filename) {
     }
     
     print_scheduler_stats();
-    sched.scheduler_on = 0;
-    pthread_join(sched.sched_thread, NULL);
+    stop_scheduler();
     exit(0);
 }
 
@@ -1544,15 +5999,13 @@ void interactive_mode() {
         while (read(STDIN_FILENO, &c, 1) == 1) {
             if (c == 24) {  // Ctrl+X
                 printf("\nExiting shell...\n");
-                sched.scheduler_on = 0;
-                pthread_join(sched.sched_thread, NULL);
+                stop_scheduler();
                 exit(0);
             }
 
             if (ctrl_x_pressed) {
                 printf("\nExiting shell...\n");
-                sched.scheduler_on = 0;
-                pthread_join(sched.sched_thread, NULL);
+                stop_scheduler();
                 exit(0);
             }
 
@@ -1578,8 +6031,7 @@ void interactive_mode() {
 
         if (ctrl_x_pressed) {
             printf("\nExiting shell...\n");
-            sched.scheduler_on = 0;
-            pthread_join(sched.sched_thread, NULL);
+            stop_scheduler();
             exit(0);
         }
 
@@ -1587,8 +6039,7 @@ void interactive_mode() {
 
         if (strcmp(input, "quit") == 0) {
             printf("Exiting shell...\n");
-            sched.scheduler_on = 0;
-            pthread_join(sched.sched_thread, NULL);
+            stop_scheduler();
             exit(0);
         }
 
@@ -1601,60 +6052,141 @@ void interactive_mode() {
 }
 
 void cleanup_resources() {
-    sched.scheduler_on = 0;
-    if (sched.sched_thread) {
-        pthread_join(sched.sched_thread, NULL);
-    }
-    
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (vmm.processes[i].page_table != NULL) {
-            free(vmm.processes[i].page_table);
-        }
+    stop_scheduler();
+    for (int i = 0; i < sched.num_cpus; i++) {
+        free(sched.cpus[i].waiting.items);
     }
+    free(sched.cpus);
+    sched.cpus = NULL;
+    sched.num_cpus = 0;
+    free(sched.pids.slots);
+    free(pcb_pool.slots);
+    pcb_pool.slots = NULL;
+    cleanup_vmm();
+    index_shutdown();
     
     printf("Resources cleaned up.\n");
 }
 
-void init_scheduler() {
-    pthread_mutex_init(&sched.ready.lock, NULL);
-    pthread_mutex_init(&sched.waiting.lock, NULL);
+void init_scheduler(int num_cpus, int max_processes) {
+    if (init_pcb_pool(max_processes) != 0) {
+        perror("Failed to allocate PCB pool");
+        exit(1);
+    }
+
+    sched.cpus = calloc(num_cpus, sizeof(CPU));
+    if (!sched.cpus) {
+        perror("Failed to allocate CPUs");
+        exit(1);
+    }
+    sched.num_cpus = num_cpus;
     sched.scheduler_on = 1;
     sched.total_procs = 0;
     sched.done_procs = 0;
     sched.total_wait = 0;
     sched.total_turnaround = 0;
-    sched.running = NULL;
-    sched.ready.head = NULL;
-    sched.ready.count = 0;
-    sched.waiting.head = NULL;
-    sched.waiting.count = 0;
-    
-    pthread_create(&sched.sched_thread, NULL, scheduler_main, NULL);
+    sched.total_real_cpu = 0;
+    sched.total_ctx_switches = 0;
+    sched.peak_rss_kb = 0;
+    sched.pids.slots = NULL;
+    sched.pids.capacity = 0;
+    sched.pids.count = 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    // calloc leaves every queue empty and every counter zero
+    for (int i = 0; i < num_cpus; i++) {
+        CPU* cpu = &sched.cpus[i];
+        cpu->id = i;
+        cpu->idle = 1;
+        cpu->seed = (unsigned int)time(NULL) + i;
+        pthread_mutex_init(&cpu->lock, NULL);
+        pthread_mutex_init(&cpu->event_lock, NULL);
+        pthread_cond_init(&cpu->event_cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+
+    for (int i = 0; i < num_cpus; i++) {
+        pthread_create(&sched.cpus[i].thread, NULL, scheduler_main, &sched.cpus[i]);
+    }
     
     if (scheduler_verbose) {
         printf("Combined Scheduler initialized:\n");
-        printf("  Algorithm: Round Robin + Priority + Aging\n");
+        printf("  Algorithm: %s\n", sched_policy->description);
         printf("  Time Slice: %dms\n", TIME_SLICE/1000);
         printf("  Aging: Every %d cycles\n", AGING_BOOST);
+        printf("  CPUs: %d (per-CPU run queues, work stealing)\n", num_cpus);
         printf("  Preemptive: YES\n");
+        printf("  Wakeups: event driven (idle until arrival or deadline)\n");
     }
 }
 
 int main(int argc, char *argv[]) {
+    // Simulated CPU count defaults to the online cores
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int arg_index = 1;
+
+    // VMM geometry: defaults, then VMM_* environment, then command line
+    const char* geometry_env[] = { "VMM_PAGE_SIZE", "VMM_FRAMES", "VMM_VIRTUAL_PAGES",
+                                   "VMM_SWAP_SLOTS", "VMM_PROCESSES" };
+    const char geometry_flags[] = { 'p', 'f', 'v', 's', 'm' };
+    long long geometry[] = { DEFAULT_PAGE_SIZE, DEFAULT_FRAMES, DEFAULT_VIRTUAL_PAGES,
+                             DEFAULT_SWAP_SLOTS, DEFAULT_PROCESSES };
+    for (int g = 0; g < 5; g++) {
+        const char* value = getenv(geometry_env[g]);
+        if (value) geometry[g] = parse_size(value);
+    }
+
+    while (arg_index + 1 < argc && argv[arg_index][0] == '-' && argv[arg_index][1] &&
+           !argv[arg_index][2]) {
+        char flag = argv[arg_index][1];
+        if (flag == 'c') {
+            num_cpus = atoi(argv[arg_index + 1]);
+        } else {
+            const char* match = memchr(geometry_flags, flag, sizeof(geometry_flags));
+            if (!match) break;
+            geometry[match - geometry_flags] = parse_size(argv[arg_index + 1]);
+        }
+        arg_index += 2;
+    }
+    if (num_cpus < 1) num_cpus = 1;
+    if (num_cpus > MAX_CPUS) num_cpus = MAX_CPUS;
+
+    long long page_size = geometry[0];
+    if (page_size < 512 || page_size > (1LL << 30) || (page_size & (page_size - 1))) {
+        fprintf(stderr, "Page size must be a power of two between 512 and 1G\n");
+        exit(1);
+    }
+    // Frames and swap slots must fit their PTE fields
+    const long long geometry_max[] = { 0, PTE_MAX_FRAMES, 1 << 30, PTE_MAX_SWAP_SLOTS, MAX_PROCESSES_LIMIT };
+    for (int g = 1; g < 5; g++) {
+        if (geometry[g] < 1 || geometry[g] > geometry_max[g]) {
+            fprintf(stderr, "Invalid %s (-%c): must be between 1 and %lld\n",
+                    geometry_env[g], geometry_flags[g], geometry_max[g]);
+            exit(1);
+        }
+    }
+
     // Initialize systems
-    init_vmm();
-    init_scheduler();
+    if (init_vmm((int)page_size, (int)geometry[1], (int)geometry[2],
+                 (int)geometry[3], (int)geometry[4]) != 0) {
+        perror("Failed to allocate VMM tables");
+        exit(1);
+    }
+    init_scheduler((int)num_cpus, (int)geometry[4]);
     
     // Set up cleanup
     atexit(cleanup_resources);
     
     printf("=== Lope Shell ===\n");
-    printf("VMM: %d frames (%d KB), Scheduler: RR+Priority+Aging\n", 
-           PHYSICAL_FRAMES, (PHYSICAL_FRAMES * PAGE_SIZE) / 1024);
+    printf("VMM: %d frames (%ld KB), Scheduler: RR+Priority+Aging on %ld CPU(s)\n", 
+           vmm.num_frames, ((long)vmm.num_frames * vmm.page_size) / 1024, num_cpus);
 
-    if (argc > 1) {
+    if (argc > arg_index) {
         is_interactive = 0;
-        process_batch_file(argv[1]);
+        process_batch_file(argv[arg_index]);
     } else {
         is_interactive = 1;
         interactive_mode();